@@ -0,0 +1,425 @@
+#!/usr/bin/env python3
+"""Benchmarks of tcp-proxy against local backends, python3 stdlib only.
+
+usage: bench/bench.py [--proxy ./bin/tcp-proxy] [--threads N] SCENARIO...
+
+scenarios:
+  rate     throughput of one download under --rate-conn and of four under
+           --rate-global
+  quantum  ping-pong RTT next to bulk downloads on one worker, with and
+           without --quantum
+  unix     throughput and ping-pong RTT, TCP loopback vs unix sockets
+  udp      datagrams/s echoed through --udp, and relayed per second of
+           proxy CPU time
+  accept   connect-to-echo latency of new connections, reuseport vs
+           shared, with and without one worker stalled (ptrace, 20ms of
+           every 25ms)
+  profile  proxy CPU time per GiB, --cpu-profile off vs on
+
+Everything runs on this host, so proxy competes for CPU with backends and
+clients; compare numbers of one run rather than across machines.
+"""
+
+import argparse
+import ctypes
+import multiprocessing
+import os
+import signal
+import socket
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CHUNK = 1 << 20
+
+
+def free_port(kind=socket.SOCK_STREAM):
+    with socket.socket(socket.AF_INET, kind) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def cpu_ns(pid):
+    # time all threads of pid spent on CPU
+    total = 0
+    for tid in os.listdir("/proc/%d/task" % pid):
+        with open("/proc/%d/task/%s/schedstat" % (pid, tid)) as f:
+            total += int(f.read().split()[0])
+    return total
+
+
+# backends, each connection starts with mode byte:
+# E - echo, D - send data until client closes
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        s = self.request
+        mode = s.recv(1)
+        try:
+            if mode == b"E":
+                while True:
+                    data = s.recv(65536)
+                    if not data:
+                        break
+                    s.sendall(data)
+            elif mode == b"D":
+                data = b"x" * CHUNK
+                while True:
+                    s.sendall(data)
+        except OSError:
+            pass
+
+
+class TCPBackend(socketserver.ForkingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    request_queue_size = 1024
+    max_children = 4096
+
+
+class UnixBackend(socketserver.ForkingMixIn, socketserver.UnixStreamServer):
+    request_queue_size = 1024
+    max_children = 4096
+
+
+class ThreadingTCPBackend(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    # no fork() per connection, for latency of short connections
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 1024
+
+
+def start_backend(addr, threads=False):
+    """addr is port or unix socket path, return process serving it"""
+    if threads:
+        server = ThreadingTCPBackend(("127.0.0.1", addr), Handler)
+    elif isinstance(addr, int):
+        server = TCPBackend(("127.0.0.1", addr), Handler)
+    else:
+        server = UnixBackend(addr, Handler)
+
+    proc = multiprocessing.Process(target=server.serve_forever, daemon=True)
+    proc.start()
+    server.socket.close()
+    return proc
+
+
+def udp_echo(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    s.bind(("127.0.0.1", port))
+    while True:
+        data, addr = s.recvfrom(2048)
+        try:
+            s.sendto(data, addr)
+        except OSError:
+            pass
+
+
+class Proxy:
+    def __init__(self, binary, threads, listen, upstream, args=()):
+        env = dict(os.environ, OMP_NUM_THREADS=str(threads))
+        cmd = [binary] + list(args) + [listen, upstream]
+        self.proc = subprocess.Popen(cmd, env=env, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.pid = self.proc.pid
+        self.threads = threads
+        time.sleep(0.3)
+        if self.proc.poll() is not None:
+            sys.exit("proxy exited: %s" % " ".join(cmd))
+
+    def workers(self):
+        """tids of worker threads, without resolver, access logger or
+        capture writer enabled they are all threads but main"""
+        tids = sorted(int(t) for t in os.listdir("/proc/%d/task" % self.pid))
+        return [t for t in tids if t != self.pid][: self.threads]
+
+    def stop(self):
+        self.proc.send_signal(signal.SIGTERM)
+        try:
+            self.proc.wait(5)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+
+
+def connect(addr):
+    if isinstance(addr, int):
+        s = socket.create_connection(("127.0.0.1", addr))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    else:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(addr)
+    return s
+
+
+def download(addr, nbytes=None, seconds=None, warmup=0):
+    """return bytes/s of downloading nbytes or for seconds, not counting
+    first warmup seconds"""
+    s = connect(addr)
+    s.sendall(b"D")
+    buf = bytearray(CHUNK)
+    got, start = 0, time.monotonic()
+    while True:
+        n = s.recv_into(buf)
+        if not n:
+            break
+        got += n
+        elapsed = time.monotonic() - start
+        if warmup and elapsed >= warmup:
+            got, start, warmup = 0, time.monotonic(), 0
+        if (nbytes and got >= nbytes) or (seconds and elapsed >= seconds):
+            break
+    s.close()
+    return got / (time.monotonic() - start)
+
+
+def ping(addr, count, interval=0.0):
+    """return RTTs of count 64 byte messages echoed back"""
+    s = connect(addr)
+    s.sendall(b"E")
+    msg, rtts = b"p" * 64, []
+    for _ in range(count):
+        start = time.monotonic()
+        s.sendall(msg)
+        got = 0
+        while got < len(msg):
+            got += len(s.recv(65536))
+        rtts.append(time.monotonic() - start)
+        if interval:
+            time.sleep(interval)
+    s.close()
+    return rtts
+
+
+def fmt_rtt(rtts):
+    return "p50=%.0fus p99=%.0fus max=%.0fus" % (
+        percentile(rtts, 50) * 1e6, percentile(rtts, 99) * 1e6, max(rtts) * 1e6)
+
+
+def bench_rate(opts):
+    up, port = free_port(), free_port()
+    backend = start_backend(up)
+    try:
+        for args, conns in (([], 1), (["--rate-conn=10M"], 1), (["--rate-global=20M"], 4)):
+            proxy = Proxy(opts.proxy, opts.threads, "127.0.0.1:%d" % port, "127.0.0.1:%d" % up, args)
+            rates = []
+            # buckets start full and let one second worth of bytes through at once
+            threads = [threading.Thread(target=lambda: rates.append(download(port, seconds=5, warmup=2)))
+                       for _ in range(conns)]
+            for t in threads: t.start()
+            for t in threads: t.join()
+            proxy.stop()
+            print("rate %-18s conns=%d total=%.1fMiB/s per conn=%s" % (
+                " ".join(args) or "unlimited", conns, sum(rates) / (1 << 20),
+                ",".join("%.1f" % (r / (1 << 20)) for r in rates)))
+    finally:
+        backend.terminate()
+
+
+def bench_quantum(opts):
+    up, port = free_port(), free_port()
+    backend = start_backend(up)
+    try:
+        for args in ([], ["--quantum=64K"]):
+            proxy = Proxy(opts.proxy, 1, "127.0.0.1:%d" % port, "127.0.0.1:%d" % up, args)
+
+            # bulk clients run in separate processes, so they don't hold GIL of pinger
+            procs = [multiprocessing.Process(target=download, args=(port,), daemon=True) for _ in range(4)]
+            for p in procs: p.start()
+            time.sleep(0.5)
+            rtts = ping(port, 2000, 0.001)
+            for p in procs: p.terminate()
+            proxy.stop()
+            print("quantum %-14s 4 bulk downloads, ping %s" % (" ".join(args) or "off", fmt_rtt(rtts)))
+    finally:
+        backend.terminate()
+
+
+def bench_unix(opts):
+    tmp = tempfile.mkdtemp()
+    up_tcp, port = free_port(), free_port()
+    up_unix, listen_unix = os.path.join(tmp, "up.sock"), os.path.join(tmp, "proxy.sock")
+    backends = [start_backend(up_tcp), start_backend(up_unix)]
+    try:
+        for name, listen, upstream, client in (
+                ("tcp->tcp", "127.0.0.1:%d" % port, "127.0.0.1:%d" % up_tcp, port),
+                ("unix->unix", "unix:" + listen_unix, "unix:" + up_unix, listen_unix)):
+            proxy = Proxy(opts.proxy, 1, listen, upstream)
+            rate = max(download(client, nbytes=2 << 30) for _ in range(3))
+            rtts = ping(client, 5000)
+            proxy.stop()
+            print("unix %-10s download %.0fMiB/s, ping %s" % (name, rate / (1 << 20), fmt_rtt(rtts)))
+    finally:
+        for b in backends: b.terminate()
+
+
+def bench_udp(opts):
+    up, port = free_port(socket.SOCK_DGRAM), free_port(socket.SOCK_DGRAM)
+    backend = multiprocessing.Process(target=udp_echo, args=(up,), daemon=True)
+    backend.start()
+    try:
+        for args in (["--udp"], ["--udp", "--udp-gro"]):
+            proxy = Proxy(opts.proxy, 1, "127.0.0.1:%d" % port, "127.0.0.1:%d" % up, args)
+            s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+            s.connect(("127.0.0.1", port))
+            s.settimeout(0.5)
+
+            def flood(seconds):
+                # separate process shares the socket, parent only receives
+                msg, end = b"u" * 64, time.monotonic() + seconds
+                while time.monotonic() < end:
+                    try:
+                        s.send(msg)
+                    except OSError:
+                        pass
+
+            sender = multiprocessing.Process(target=flood, args=(3,), daemon=True)
+            cpu_start, start = cpu_ns(proxy.pid), time.monotonic()
+            sender.start()
+            got = 0
+            try:
+                while True:
+                    s.recv(2048)
+                    got += 1
+            except socket.timeout:
+                pass
+            elapsed = time.monotonic() - start - 0.5
+            cpu = (cpu_ns(proxy.pid) - cpu_start) / 1e9
+            sender.join()
+            s.close()
+            proxy.stop()
+            # each echoed datagram is relayed twice
+            print("udp %-16s echoed %.0f datagrams/s, proxy cpu %.2fs, %.0f relayed per cpu second" % (
+                " ".join(args), got / elapsed, cpu, 2 * got / cpu if cpu else 0))
+    finally:
+        backend.terminate()
+
+
+class Stall:
+    """keep thread tid stopped for stall of every period seconds"""
+
+    PTRACE_CONT, PTRACE_DETACH = 7, 17
+    PTRACE_SEIZE, PTRACE_INTERRUPT = 0x4206, 0x4207
+    WALL = 0x40000000
+
+    def __init__(self, tid, stall=0.020, period=0.025):
+        self.stop = multiprocessing.Event()
+        self.proc = multiprocessing.Process(target=self.run, args=(tid, stall, period), daemon=True)
+        self.proc.start()
+
+    def run(self, tid, stall, period):
+        libc = ctypes.CDLL(None, use_errno=True)
+        libc.ptrace.argtypes = [ctypes.c_long, ctypes.c_long, ctypes.c_void_p, ctypes.c_void_p]
+        if libc.ptrace(self.PTRACE_SEIZE, tid, None, None):
+            sys.exit("ptrace(SEIZE, %d): %s" % (tid, os.strerror(ctypes.get_errno())))
+
+        while True:
+            libc.ptrace(self.PTRACE_INTERRUPT, tid, None, None)
+            os.waitpid(tid, self.WALL)
+            if self.stop.is_set():
+                break
+            time.sleep(stall)
+            libc.ptrace(self.PTRACE_CONT, tid, None, None)
+            time.sleep(period - stall)
+
+        libc.ptrace(self.PTRACE_DETACH, tid, None, None)
+
+    def finish(self):
+        self.stop.set()
+        self.proc.join()
+
+
+def bench_accept(opts):
+    up, port = free_port(), free_port()
+    backend = start_backend(up, threads=True)
+    threads = max(opts.threads, 4)
+    try:
+        for model in ("reuseport", "shared"):
+            for stalled in (False, True):
+                proxy = Proxy(opts.proxy, threads, "127.0.0.1:%d" % port, "127.0.0.1:%d" % up,
+                              ["--accept-model=" + model])
+                stall = Stall(proxy.workers()[0]) if stalled else None
+                time.sleep(0.1)
+
+                lat, end = [], time.monotonic() + 5
+                def client():
+                    while time.monotonic() < end:
+                        start = time.monotonic()
+                        s = connect(port)
+                        s.sendall(b"E1")
+                        s.recv(1)
+                        lat.append(time.monotonic() - start)
+                        s.close()
+                        time.sleep(0.002)
+
+                clients = [threading.Thread(target=client) for _ in range(4)]
+                for c in clients: c.start()
+                for c in clients: c.join()
+                if stall: stall.finish()
+                proxy.stop()
+                print("accept %-10s %d workers, %d stalled, %d conns: p50=%.1fms p99=%.1fms max=%.1fms" % (
+                    model, threads, stalled, len(lat), percentile(lat, 50) * 1e3,
+                    percentile(lat, 99) * 1e3, max(lat) * 1e3))
+    finally:
+        backend.terminate()
+
+
+def bench_profile(opts):
+    up = free_port()
+    backend = start_backend(up)
+    configs = ([], ["--cpu-profile=1000"], ["--cpu-profile=1"])
+    nbytes = 2 << 30
+    try:
+        # all proxies run at once and take turns, so drift of host affects them equally
+        proxies = []
+        for args in configs:
+            port = free_port()
+            proxies.append((port, Proxy(opts.proxy, 1, "127.0.0.1:%d" % port, "127.0.0.1:%d" % up, args)))
+
+        costs = [[] for _ in configs]
+        for _ in range(7):
+            for (port, proxy), cost in zip(proxies, costs):
+                start = cpu_ns(proxy.pid)
+                download(port, nbytes=nbytes)
+                cost.append((cpu_ns(proxy.pid) - start) / 1e6 / (nbytes / (1 << 30)))
+
+        for args, (port, proxy), cost in zip(configs, proxies, costs):
+            proxy.stop()
+            print("profile %-18s proxy cpu per GiB: median %.1fms min %.1fms max %.1fms" % (
+                " ".join(args) or "off", percentile(cost, 50), min(cost), max(cost)))
+    finally:
+        backend.terminate()
+
+
+def main():
+    scenarios = {
+        "rate": bench_rate,
+        "quantum": bench_quantum,
+        "unix": bench_unix,
+        "udp": bench_udp,
+        "accept": bench_accept,
+        "profile": bench_profile,
+    }
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--proxy", default=os.path.join(ROOT, "bin", "tcp-proxy"))
+    parser.add_argument("--threads", type=int, default=os.cpu_count())
+    parser.add_argument("scenario", nargs="+", choices=sorted(scenarios))
+    opts = parser.parse_args()
+
+    multiprocessing.set_start_method("fork")
+    for name in opts.scenario:
+        scenarios[name](opts)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+
+static
+int _open(access_log_t* log)
+{
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        ERRP("Failed to open access log %s", log->path);
+        return -1;
+    }
+
+    struct stat st;
+    log->size = fstat(log->fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+static
+void _rotate(access_log_t* log)
+{
+    // keep one previous file, path.1
+    char old[PATH_MAX];
+    snprintf(old, sizeof(old), "%s.1", log->path);
+
+    if (rename(log->path, old))
+        ERRP("Failed to rotate access log %s", log->path);
+
+    close(log->fd);
+    _open(log);
+}
+
+static
+void _write(access_log_t* log, const access_record_t* records, size_t count)
+{
+    size_t len = count * sizeof(access_record_t);
+    if (log->max_size && log->size && log->size + len > log->max_size)
+        _rotate(log);
+
+    // records are dropped while file can't be written
+    if (log->fd < 0 && _open(log)) return;
+
+    const char* buf = (const char*) records;
+    while (len) {
+        ssize_t ret = write(log->fd, buf, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            ERRP("Failed to write access log %s", log->path);
+            return;
+        }
+
+        buf += ret;
+        len -= ret;
+        log->size += ret;
+    }
+}
+
+access_log_t* access_log_open(const char* path, size_t max_size)
+{
+    access_log_t* log = calloc_or_die(1, sizeof(access_log_t));
+    log->path = path;
+    log->max_size = max_size;
+
+    if (_open(log)) {
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+void access_log_close(access_log_t* log)
+{
+    if (!log) return;
+    if (log->fd >= 0) close(log->fd);
+    free(log);
+}
+
+size_t access_log_drain(access_log_t* log, access_ring_t* ring, uint16_t worker)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        // contiguous part, up to the end of ring
+        size_t pos = tail & ring->mask;
+        size_t count = head - tail;
+        if (count > ring->mask + 1 - pos) count = ring->mask + 1 - pos;
+
+        for (size_t i = 0; i < count; ++i)
+            ring->records[pos + i].worker = worker;
+
+        _write(log, &ring->records[pos], count);
+        tail += count;
+    }
+
+    size_t count = tail - ring->tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
@@ -0,0 +1,117 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "net.h"
+#include "common.h"
+
+#define ACCESS_RECORD_VERSION 1
+#define ACCESS_RING_SIZE      4096      // records per worker (power of 2)
+
+// why connection ended, access_record_t.reason
+#define CLOSE_UNKNOWN          0        // connection wasn't closed by proxy itself
+#define CLOSE_DOWNSTREAM_EOF   1        // client closed connection
+#define CLOSE_UPSTREAM_EOF     2        // upstream closed connection
+#define CLOSE_DOWNSTREAM_ERROR 3
+#define CLOSE_UPSTREAM_ERROR   4
+#define CLOSE_CONNECT_FAILED   5        // none of upstream addresses could be connected
+#define CLOSE_PROTOCOL         6        // invalid PROXY header, failed TLS handshake
+#define CLOSE_REJECTED         7        // client address from PROXY header isn't admitted
+#define CLOSE_ADMIN            8        // closed by admin command
+
+/* one record per connection, written as is (host byte order, no
+ * padding) to --access-log file. Addresses are IPv6, IPv4 ones are
+ * IPv4-mapped, unix sockets are all zeros */
+typedef struct {
+    uint64_t start_us;                  // unix time connection was accepted
+    uint64_t bytes_up;                  // read from client and passed to upstream
+    uint64_t bytes_down;                // read from upstream and passed to client
+    uint32_t connect_us;                // from accept to connected upstream, 0 if it never was
+    uint32_t duration_ms;
+    uint8_t client_addr[16];
+    uint8_t upstream_addr[16];          // address upstream connection was made to
+    uint16_t client_port;
+    uint16_t upstream_port;
+    uint16_t worker;
+    uint8_t reason;                     // CLOSE_*
+    uint8_t version;                    // ACCESS_RECORD_VERSION
+} access_record_t;
+
+/* single-producer single-consumer ring, worker pushes
+ * records and logger thread writes them out in batches */
+typedef struct {
+    access_record_t* records;
+    size_t mask;
+    size_t head;                        // next position for worker
+    size_t tail;                        // next position for logger
+} access_ring_t;
+
+typedef struct {
+    const char* path;
+    size_t max_size;                    // rotate once file grows over it, 0 - never
+    size_t size;
+    int fd;
+} access_log_t;
+
+inline static
+int access_ring_init(access_ring_t* ring, size_t size)
+{
+    // size must be power of 2
+    ring->records = (access_record_t*) calloc(size, sizeof(access_record_t));
+    if (!ring->records) return -1;
+
+    ring->mask = size - 1;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+inline static
+void access_ring_free(access_ring_t* ring)
+{
+    free(ring->records);
+    ring->records = NULL;
+}
+
+// return slot for next record or NULL if ring is full, access_ring_commit() publishes it
+inline static
+access_record_t* access_ring_reserve(access_ring_t* ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail > ring->mask) return NULL;
+    return &ring->records[ring->head & ring->mask];
+}
+
+inline static
+void access_ring_commit(access_ring_t* ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+inline static
+void access_record_addr(uint8_t* addr, uint16_t* port, const socket_t* sock)
+{
+    memset(addr, 0, 16);
+    *port = 0;
+
+    if (sock->addr.ss_family == AF_INET) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) &sock->addr;
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &sin->sin_addr, 4);
+        *port = ntohs(sin->sin_port);
+    } else if (sock->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) &sock->addr;
+        memcpy(addr, &sin6->sin6_addr, 16);
+        *port = ntohs(sin6->sin6_port);
+    }
+}
+
+// open (append to) file, return NULL on error
+access_log_t* access_log_open(const char* path, size_t max_size);
+void access_log_close(access_log_t* log);
+
+// write out records pushed to ring so far, return their count
+size_t access_log_drain(access_log_t* log, access_ring_t* ring, uint16_t worker);
+
+#endif
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "acl.h"
+#include "common.h"
+
+#define STRIDE 6
+#define SLOTS  (1 << STRIDE)
+
+typedef struct {
+    uint64_t hi, lo;                    // address in host byte order, IPv4 is in top bits of hi
+    int len;                            // prefix length
+    int action;
+    size_t line;                        // keeps order of equal prefixes stable
+} acl_rule_t;
+
+// node of uncompressed trie, exists only while building
+typedef struct _build_node {
+    struct _build_node* child[SLOTS];
+    uint8_t leaf[SLOTS];
+} build_node_t;
+
+inline static
+unsigned int _slot(uint64_t hi, uint64_t lo, int off)
+{
+    // STRIDE bits starting at bit off (counting from MSB), bits past the end are 0
+    if (off + STRIDE <= 64) return (hi >> (64 - STRIDE - off)) & (SLOTS - 1);
+    if (off < 64) return ((hi << (off + STRIDE - 64)) | (lo >> (128 - STRIDE - off))) & (SLOTS - 1);
+
+    off -= 64;
+    if (off + STRIDE <= 64) return (lo >> (64 - STRIDE - off)) & (SLOTS - 1);
+    return (lo << (off + STRIDE - 64)) & (SLOTS - 1);
+}
+
+inline static
+uint8_t _lookup(const poptrie_t* t, uint64_t hi, uint64_t lo)
+{
+    const acl_node_t* node = &t->nodes[0];
+    for (int off = 0; ; off += STRIDE) {
+        uint64_t bit = 1ULL << _slot(hi, lo, off);
+
+        if (!(node->vector & bit)) {
+            // (bit << 1) - 1 is all ones for the last slot as well
+            return t->leaves[node->base0 + __builtin_popcountll(node->leafvec & ((bit << 1) - 1)) - 1];
+        }
+
+        node = &t->nodes[node->base1 + __builtin_popcountll(node->vector & (bit - 1))];
+    }
+}
+
+int acl_allowed(const acl_t* acl, const struct sockaddr_storage* addr)
+{
+    uint8_t action = ACL_NONE;
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        action = _lookup(&acl->v4, (uint64_t) ntohl(sin->sin_addr.s_addr) << 32, 0);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr* in6 = &((const struct sockaddr_in6*) addr)->sin6_addr;
+        uint64_t hi, lo;
+        memcpy(&hi, in6->s6_addr, 8);
+        memcpy(&lo, in6->s6_addr + 8, 8);
+
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            action = _lookup(&acl->v4, (be64toh(lo) & 0xffffffff) << 32, 0);
+        } else {
+            action = _lookup(&acl->v6, be64toh(hi), be64toh(lo));
+        }
+    }
+
+    if (action == ACL_NONE) action = acl->fallback;
+    return action == ACL_ALLOW;
+}
+
+/******************************************************************
+ * building                                                       *
+ ******************************************************************/
+
+static
+build_node_t* _new_build_node(uint8_t leaf)
+{
+    build_node_t* node = calloc_or_die(1, sizeof(build_node_t));
+    memset(node->leaf, leaf, sizeof(node->leaf));
+    return node;
+}
+
+static
+void _free_build_node(build_node_t* node)
+{
+    for (int i = 0; i < SLOTS; ++i)
+        if (node->child[i]) _free_build_node(node->child[i]);
+
+    free(node);
+}
+
+static
+void _insert(build_node_t* root, const acl_rule_t* rule)
+{
+    /* rules are inserted from shorter to longer prefixes,
+     * so new child nodes inherit current leaf value of their slot
+     * and a rule never has to update nodes below its stride */
+
+    build_node_t* node = root;
+    int off = 0;
+
+    for (; rule->len > off + STRIDE; off += STRIDE) {
+        unsigned int slot = _slot(rule->hi, rule->lo, off);
+        if (!node->child[slot])
+            node->child[slot] = _new_build_node(node->leaf[slot]);
+
+        node = node->child[slot];
+    }
+
+    // prefix ends within this node, expand it to all slots it covers
+    int free_bits = STRIDE - (rule->len - off);
+    unsigned int first = _slot(rule->hi, rule->lo, off) & ~((1U << free_bits) - 1);
+    for (unsigned int slot = first; slot < first + (1U << free_bits); ++slot)
+        node->leaf[slot] = rule->action;
+}
+
+static
+size_t _count_nodes(const build_node_t* node)
+{
+    size_t count = 1;
+    for (int i = 0; i < SLOTS; ++i)
+        if (node->child[i]) count += _count_nodes(node->child[i]);
+
+    return count;
+}
+
+static
+void _compress(poptrie_t* t, build_node_t* root)
+{
+    /* lay nodes out in BFS order: children of a node are appended
+     * right after nodes already placed, so they're contiguous and
+     * the array doubles as BFS queue */
+
+    size_t count = _count_nodes(root);
+    build_node_t** queue = calloc_or_die(count, sizeof(build_node_t*));
+
+    t->nodes = calloc_or_die(count, sizeof(acl_node_t));
+    t->leaves = calloc_or_die(count * SLOTS, sizeof(uint8_t));
+    t->nodes_count = 1;
+    t->leaves_count = 0;
+    queue[0] = root;
+
+    for (size_t i = 0; i < t->nodes_count; ++i) {
+        build_node_t* bnode = queue[i];
+        acl_node_t* node = &t->nodes[i];
+        node->base0 = t->leaves_count;
+        node->base1 = t->nodes_count;
+
+        int prev = -1;
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            if (bnode->child[slot]) {
+                node->vector |= 1ULL << slot;
+                queue[t->nodes_count++] = bnode->child[slot];
+            } else if (bnode->leaf[slot] != prev) {
+                node->leafvec |= 1ULL << slot;
+                t->leaves[t->leaves_count++] = bnode->leaf[slot];
+                prev = bnode->leaf[slot];
+            }
+        }
+    }
+
+    // at least root has leaves unless all its slots lead to children
+    if (t->leaves_count)
+        t->leaves = realloc(t->leaves, t->leaves_count) ?: t->leaves;
+
+    free(queue);
+}
+
+static
+void _build(poptrie_t* t, const acl_rule_t* rules, size_t count)
+{
+    // rules must be sorted by prefix length
+    build_node_t* root = _new_build_node(ACL_NONE);
+    for (size_t i = 0; i < count; ++i)
+        _insert(root, &rules[i]);
+
+    _compress(t, root);
+    _free_build_node(root);
+}
+
+static
+int _cmp_rules(const void* a, const void* b)
+{
+    const acl_rule_t* ra = (const acl_rule_t*) a;
+    const acl_rule_t* rb = (const acl_rule_t*) b;
+    if (ra->len != rb->len) return ra->len - rb->len;
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+static
+int _parse_rule(char* line, acl_rule_t* rule, int* family)
+{
+    // "allow|deny address[/len]", return 1 for rule, 0 for empty line, -1 for error
+    char* action = strtok(line, " \t\r\n");
+    if (!action || action[0] == '#') return 0;
+
+    char* prefix = strtok(NULL, " \t\r\n");
+    char* extra = strtok(NULL, " \t\r\n");
+    if (!prefix || (extra && extra[0] != '#')) return -1;
+
+    if (strcmp(action, "allow") == 0) {
+        rule->action = ACL_ALLOW;
+    } else if (strcmp(action, "deny") == 0) {
+        rule->action = ACL_DENY;
+    } else {
+        return -1;
+    }
+
+    char* slash = strchr(prefix, '/');
+    if (slash) *slash = '\0';
+
+    unsigned char buf[16];
+    if (inet_pton(AF_INET, prefix, buf) == 1) {
+        uint32_t v4;
+        memcpy(&v4, buf, 4);
+        rule->hi = (uint64_t) ntohl(v4) << 32;
+        rule->lo = 0;
+        rule->len = 32;
+        *family = AF_INET;
+    } else if (inet_pton(AF_INET6, prefix, buf) == 1) {
+        memcpy(&rule->hi, buf, 8);
+        memcpy(&rule->lo, buf + 8, 8);
+        rule->hi = be64toh(rule->hi);
+        rule->lo = be64toh(rule->lo);
+        rule->len = 128;
+        *family = AF_INET6;
+    } else {
+        return -1;
+    }
+
+    if (slash) {
+        char* end = NULL;
+        long len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || len < 0 || len > rule->len) return -1;
+        rule->len = len;
+    }
+
+    // clear host bits
+    if (rule->len < 64) {
+        rule->hi &= rule->len ? ~0ULL << (64 - rule->len) : 0;
+        rule->lo = 0;
+    } else if (rule->len < 128) {
+        rule->lo &= rule->len > 64 ? ~0ULL << (128 - rule->len) : 0;
+    }
+
+    return 1;
+}
+
+acl_t* acl_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        ERRP("Failed to open ACL file %s", path);
+        return NULL;
+    }
+
+    size_t size = 16, v4_count = 0, v6_count = 0, allow_count = 0;
+    acl_rule_t* v4_rules = malloc_or_die(size * sizeof(acl_rule_t));
+    acl_rule_t* v6_rules = malloc_or_die(size * sizeof(acl_rule_t));
+    acl_t* acl = NULL;
+
+    char* line = NULL;
+    size_t line_size = 0;
+    size_t line_no = 0;
+
+    while (getline(&line, &line_size, file) != -1) {
+        acl_rule_t rule;
+        int family = AF_UNSPEC;
+        int ret = _parse_rule(line, &rule, &family);
+        ++line_no;
+
+        if (ret < 0) {
+            ERR("Invalid rule in %s at line %zu", path, line_no);
+            goto error;
+        }
+
+        if (ret == 0) continue;
+
+        if (v4_count == size || v6_count == size) {
+            size *= 2;
+            v4_rules = realloc(v4_rules, size * sizeof(acl_rule_t));
+            v6_rules = realloc(v6_rules, size * sizeof(acl_rule_t));
+            if (!v4_rules || !v6_rules) ERRPX("Failed to allocate ACL rules");
+        }
+
+        rule.line = line_no;
+        if (family == AF_INET) {
+            v4_rules[v4_count++] = rule;
+        } else {
+            v6_rules[v6_count++] = rule;
+        }
+
+        if (rule.action == ACL_ALLOW) allow_count++;
+    }
+
+    qsort(v4_rules, v4_count, sizeof(acl_rule_t), _cmp_rules);
+    qsort(v6_rules, v6_count, sizeof(acl_rule_t), _cmp_rules);
+
+    acl = calloc_or_die(1, sizeof(acl_t));
+    _build(&acl->v4, v4_rules, v4_count);
+    _build(&acl->v6, v6_rules, v6_count);
+    acl->fallback = allow_count ? ACL_DENY : ACL_ALLOW;
+    acl->rules = v4_count + v6_count;
+
+    INFO("loaded %zu ACL rules from %s (%zu + %zu trie nodes), not matching addresses are %s",
+         acl->rules, path, acl->v4.nodes_count, acl->v6.nodes_count,
+         acl->fallback == ACL_ALLOW ? "allowed" : "denied");
+
+error:
+    free(line);
+    free(v4_rules);
+    free(v6_rules);
+    fclose(file);
+    return acl;
+}
+
+void acl_free(acl_t* acl)
+{
+    if (!acl) return;
+
+    free(acl->v4.nodes);
+    free(acl->v4.leaves);
+    free(acl->v6.nodes);
+    free(acl->v6.leaves);
+    free(acl);
+}
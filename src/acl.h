@@ -0,0 +1,51 @@
+#ifndef __ACL_H__
+#define __ACL_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define ACL_NONE  0                     // no rule matches, default applies
+#define ACL_ALLOW 1
+#define ACL_DENY  2
+
+/* poptrie: multibit trie with 6 bit stride. Each node covers 64 slots,
+ * a slot either leads to a child node or is a leaf carrying result of
+ * longest prefix match. Children and leaves of a node are stored
+ * contiguously, so node keeps only bitmaps and base indexes and slot
+ * is found by popcount(). Consecutive equal leaves are stored once.
+ * IPv4 lookup touches at most 6 nodes, IPv6 at most 22 */
+typedef struct {
+    uint64_t vector;                    // slots which lead to child node
+    uint64_t leafvec;                   // leaf slots which start a run of equal leaves
+    uint32_t base0;                     // index of first leaf in leaves
+    uint32_t base1;                     // index of first child in nodes
+} acl_node_t;
+
+typedef struct {
+    acl_node_t* nodes;                  // nodes[0] is root
+    uint8_t* leaves;                    // ACL_* values
+    size_t nodes_count;
+    size_t leaves_count;
+} poptrie_t;
+
+typedef struct {
+    poptrie_t v4;
+    poptrie_t v6;
+    int fallback;                       // result if no rule matches
+    size_t rules;
+} acl_t;
+
+/* load rules from file, one rule per line:
+ *   allow 10.0.0.0/8
+ *   deny 10.1.2.3
+ *   deny 2001:db8::/32
+ * Longest prefix wins, later line wins for equal prefixes. If there is
+ * at least one allow rule, not matching addresses are denied. IPv4-mapped
+ * IPv6 addresses are looked up as IPv4. Return NULL on error */
+acl_t* acl_load(const char* path);
+void acl_free(acl_t* acl);
+
+// return 1 if address is allowed
+int acl_allowed(const acl_t* acl, const struct sockaddr_storage* addr);
+
+#endif
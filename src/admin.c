@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "admin.h"
+#include "config.h"
+
+#define ADMIN_IDLE_TIMEOUT 1            // seconds, main thread doesn't wait for client longer
+#define ADMIN_PROFILE_TOP  10           // default number of connections listed by profile
+
+static const char* g_help =
+    "commands:\n"
+    "  help\n"
+    "  stats                      per-worker counters\n"
+    "  conns [WORKER]             list connections\n"
+    "  kill WORKER IDX            close connection (IDX from conns)\n"
+    "  loglevel error|info\n"
+    "  drain HOST:PORT            don't connect new clients to upstream address\n"
+    "  undrain HOST:PORT\n"
+    "  capture on [ADDR[/LEN]]    start --capture (of all clients by default)\n"
+    "  capture off\n"
+    "  profile [N]                N heaviest connections per worker and CPU cost per upstream\n"
+    "  loop [WORKER]              histograms of loop iterations, poll, callbacks, events and lag\n";
+
+static
+int _parse_index(const char* str, size_t max, size_t* val)
+{
+    char* end = NULL;
+    if (!str) return -1;
+
+    unsigned long ret = strtoul(str, &end, 10);
+    if (end == str || *end != '\0' || ret >= max) return -1;
+
+    *val = ret;
+    return 0;
+}
+
+static
+int _run(admin_t* admin, size_t worker, const admin_msg_t* tmpl, FILE* out)
+{
+    // run command in one worker or all of them (worker == admin->count)
+    size_t first = worker < admin->count ? worker : 0;
+    size_t last = worker < admin->count ? worker + 1 : admin->count;
+
+    for (size_t i = first; i < last; ++i) {
+        admin_msg_t* msg = malloc_or_die(sizeof(admin_msg_t));
+        *msg = *tmpl;
+        msg->reply = NULL;
+        msg->reply_len = 0;
+
+        if (admin_server_ctx(&admin->sctxs[i], msg)) {
+            // worker may still use msg, leak it
+            fprintf(out, "error: worker %zu didn't run command in 1s\n", i);
+            return -1;
+        }
+
+        if (msg->reply) fwrite(msg->reply, 1, msg->reply_len, out);
+        free(msg->reply);
+        free(msg);
+    }
+
+    return 0;
+}
+
+static
+void _stats(admin_t* admin, FILE* out)
+{
+    // counters are meant to be read by main thread, no need to bother workers
+    for (size_t i = 0; i < admin->count; ++i) {
+        const server_stats_t* stats = &admin->sctxs[i].stats;
+        fprintf(out, "worker=%zu", i);
+#define X(name) fprintf(out, " " #name "=%zu", STAT_GET(stats, name));
+        SERVER_STATS(X)
+#undef X
+        fprintf(out, "\n");
+    }
+}
+
+static
+void _command(admin_t* admin, char* line, FILE* out)
+{
+    char* cmd = strtok(line, " \t\r\n");
+    char* arg1 = cmd ? strtok(NULL, " \t\r\n") : NULL;
+    char* arg2 = arg1 ? strtok(NULL, " \t\r\n") : NULL;
+    if (!cmd) return;
+
+    admin_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    size_t worker = admin->count; // all of them
+
+    if (strcmp(cmd, "help") == 0) {
+        fputs(g_help, out);
+    } else if (strcmp(cmd, "stats") == 0) {
+        _stats(admin, out);
+    } else if (strcmp(cmd, "conns") == 0) {
+        if (arg1 && _parse_index(arg1, admin->count, &worker)) {
+            fprintf(out, "error: invalid worker '%s'\n", arg1);
+            return;
+        }
+
+        msg.cmd = ADMIN_CONNS;
+        _run(admin, worker, &msg, out);
+    } else if (strcmp(cmd, "kill") == 0) {
+        if (_parse_index(arg1, admin->count, &worker) || _parse_index(arg2, gl_settings.maxconn, &msg.idx)) {
+            fprintf(out, "error: expected kill WORKER IDX\n");
+            return;
+        }
+
+        msg.cmd = ADMIN_KILL;
+        _run(admin, worker, &msg, out);
+    } else if (strcmp(cmd, "loglevel") == 0) {
+        if (arg1 && strcmp(arg1, "error") == 0) {
+            __atomic_store_n(&gl_log_level, LOGLEVEL_ERROR, __ATOMIC_RELAXED);
+        } else if (arg1 && strcmp(arg1, "info") == 0) {
+            __atomic_store_n(&gl_log_level, LOGLEVEL_INFO, __ATOMIC_RELAXED);
+        } else {
+            fprintf(out, "error: expected loglevel error|info\n");
+            return;
+        }
+
+        fprintf(out, "loglevel=%s\n", arg1);
+    } else if (strcmp(cmd, "drain") == 0 || strcmp(cmd, "undrain") == 0) {
+        socket_set_t* set = arg1 ? resolve_socket_set(arg1, 0) : NULL;
+        if (!set) {
+            fprintf(out, "error: failed to resolve '%s'\n", arg1 ? arg1 : "");
+            return;
+        }
+
+        INFO("admin command: %s %s", cmd, arg1);
+        msg.cmd = strcmp(cmd, "drain") == 0 ? ADMIN_DRAIN : ADMIN_UNDRAIN;
+        msg.set = set;
+
+        // set is leaked if some worker may still look at it
+        if (_run(admin, worker, &msg, out) == 0)
+            socket_set_unref(set);
+    } else if (strcmp(cmd, "capture") == 0) {
+        if (!gl_settings.capture) {
+            fprintf(out, "error: capture requires --capture\n");
+            return;
+        }
+
+        if (arg1 && strcmp(arg1, "off") == 0 && !arg2) {
+            msg.enable = 0;
+        } else if (arg1 && strcmp(arg1, "on") == 0) {
+            msg.enable = 1;
+            if (capture_filter_parse(arg2 ? arg2 : "all", &msg.filter)) {
+                fprintf(out, "error: invalid filter '%s', expected ADDR[/LEN]\n", arg2);
+                return;
+            }
+        } else {
+            fprintf(out, "error: expected capture on [ADDR[/LEN]]|off\n");
+            return;
+        }
+
+        msg.cmd = ADMIN_CAPTURE;
+        _run(admin, worker, &msg, out);
+    } else if (strcmp(cmd, "profile") == 0) {
+        msg.idx = ADMIN_PROFILE_TOP;
+        if (arg1 && _parse_index(arg1, 1000, &msg.idx)) {
+            fprintf(out, "error: expected profile [N], N < 1000\n");
+            return;
+        }
+
+        msg.cmd = ADMIN_PROFILE;
+        _run(admin, worker, &msg, out);
+    } else if (strcmp(cmd, "loop") == 0) {
+        if (arg1 && _parse_index(arg1, admin->count, &worker)) {
+            fprintf(out, "error: invalid worker '%s'\n", arg1);
+            return;
+        }
+
+        msg.cmd = ADMIN_LOOP;
+        _run(admin, worker, &msg, out);
+    } else {
+        fprintf(out, "error: unknown command '%s', see help\n", cmd);
+    }
+}
+
+admin_t* admin_open(const char* path, server_ctx_t* sctxs, size_t count)
+{
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(un.sun_path)) {
+        ERR("Admin socket path %s is too long", path);
+        return NULL;
+    }
+
+    strcpy(un.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ERRP("Failed to create admin socket");
+        return NULL;
+    }
+
+    // admin can kill connections, only owner may connect
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &un, sizeof(un)) || chmod(path, 0600) || listen(fd, 8)) {
+        ERRP("Failed to listen on admin socket %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    admin_t* admin = calloc_or_die(1, sizeof(admin_t));
+    admin->fd = fd;
+    admin->path = path;
+    admin->sctxs = sctxs;
+    admin->count = count;
+
+    INFO("admin socket is %s", path);
+    return admin;
+}
+
+void admin_close(admin_t* admin)
+{
+    if (!admin) return;
+
+    close(admin->fd);
+    unlink(admin->path);
+    free(admin);
+}
+
+void admin_serve(admin_t* admin, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = admin->fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return;
+
+    int fd = accept4(admin->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    /* client is served right away, with timeout it can't hold
+     * main thread (and signal handling) for long */
+    struct timeval tv = { .tv_sec = ADMIN_IDLE_TIMEOUT, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    int out_fd = dup(fd);
+    FILE* in = fdopen(fd, "r");
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!in || !out) {
+        ERRP("Failed to serve admin client");
+        if (in) fclose(in); else close(fd);
+        if (out) fclose(out); else if (out_fd >= 0) close(out_fd);
+        return;
+    }
+
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        _command(admin, line, out);
+        if (fflush(out)) break;
+    }
+
+    free(line);
+    fclose(in);
+    fclose(out);
+}
@@ -0,0 +1,23 @@
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "server_ctx.h"
+
+/* admin unix socket, served by main thread. Client sends commands,
+ * one per line, and gets reply to each of them (see admin.c for the
+ * list). Commands touching connections are run by owning worker */
+typedef struct {
+    int fd;
+    const char* path;
+    server_ctx_t* sctxs;
+    size_t count;
+} admin_t;
+
+// return NULL on error
+admin_t* admin_open(const char* path, server_ctx_t* sctxs, size_t count);
+void admin_close(admin_t* admin);
+
+// wait up to timeout_ms for admin client and serve it
+void admin_serve(admin_t* admin, int timeout_ms);
+
+#endif
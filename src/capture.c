@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "access_log.h"
+
+int capture_filter_parse(const char* str, capture_filter_t* filter)
+{
+    memset(filter, 0, sizeof(capture_filter_t));
+    if (strcmp(str, "all") == 0) return 0;
+
+    char buf[INET6_ADDRSTRLEN + 8];
+    if (strlen(str) >= sizeof(buf)) return -1;
+    strcpy(buf, str);
+
+    char* slash = strchr(buf, '/');
+    if (slash) *slash = '\0';
+
+    int max;
+    if (inet_pton(AF_INET, buf, filter->addr + 12) == 1) {
+        filter->addr[10] = filter->addr[11] = 0xff;
+        max = 32;
+    } else if (inet_pton(AF_INET6, buf, filter->addr) == 1) {
+        max = 128;
+    } else {
+        return -1;
+    }
+
+    long len = max;
+    if (slash) {
+        char* end = NULL;
+        len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || len < 0 || len > max) return -1;
+    }
+
+    // IPv4 prefix covers IPv4-mapped part as well
+    filter->len = len + 128 - max;
+    return 0;
+}
+
+int capture_filter_match(const capture_filter_t* filter, const socket_t* sock)
+{
+    uint8_t addr[16];
+    uint16_t port;
+    access_record_addr(addr, &port, sock);
+
+    int bytes = filter->len / 8, bits = filter->len % 8;
+    if (memcmp(addr, filter->addr, bytes)) return 0;
+    if (!bits) return 1;
+
+    uint8_t mask = 0xff << (8 - bits);
+    return (addr[bytes] & mask) == (filter->addr[bytes] & mask);
+}
+
+static
+int _open(capture_file_t* file)
+{
+    // splice() doesn't write to O_APPEND files, file has single writer anyway
+    file->fd = open(file->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (file->fd < 0 || lseek(file->fd, 0, SEEK_END) < 0) {
+        ERRP("Failed to open capture file %s, stopping capture", file->path);
+        if (file->fd >= 0) close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+void _fail(capture_file_t* file)
+{
+    ERRP("Failed to write capture file %s, stopping capture", file->path);
+    close(file->fd);
+    file->fd = -1;
+    file->failed = 1;
+}
+
+static
+void _discard(int pipefd, size_t len)
+{
+    char buf[4096];
+    while (len) {
+        ssize_t ret = read(pipefd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return;
+        len -= ret;
+    }
+}
+
+static
+void _write(capture_file_t* file, int pipefd, const capture_record_t* rec)
+{
+    if (!file->failed && file->fd < 0 && _open(file))
+        file->failed = 1;
+
+    if (!file->failed && write(file->fd, rec, sizeof(capture_record_t)) != sizeof(capture_record_t))
+        _fail(file);
+
+    size_t len = rec->len;
+    while (!file->failed && len) {
+        ssize_t ret = splice(pipefd, NULL, file->fd, NULL, len, SPLICE_F_MOVE);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            _fail(file);
+            break;
+        }
+
+        len -= ret;
+    }
+
+    // data has to leave pipe anyway, next record's data follows it
+    _discard(pipefd, len);
+}
+
+size_t capture_drain(capture_file_t* file, capture_ring_t* ring, int pipefd, int enabled)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // data of a record is in pipe before worker pushes it
+    for (; tail != head; ++tail)
+        _write(file, pipefd, &ring->records[tail & ring->mask]);
+
+    size_t count = tail - ring->tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (!enabled && head == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        if (file->fd >= 0) close(file->fd);
+        file->fd = -1;
+        file->failed = 0;
+    }
+
+    return count;
+}
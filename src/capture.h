@@ -0,0 +1,96 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <limits.h>
+
+#include "net.h"
+#include "common.h"
+
+#define CAPTURE_RECORD_VERSION 1
+#define CAPTURE_RING_SIZE      4096     // records per worker (power of 2)
+
+// capture_record_t.event
+#define CAPTURE_TO_UPSTREAM   0         // data client sent, same values as DIR_*
+#define CAPTURE_TO_DOWNSTREAM 1         // data upstream sent
+#define CAPTURE_OPEN          2         // connection matched filter, no data
+#define CAPTURE_CLOSE         3         // connection is closed, no data
+
+/* header of every record in capture file, followed by len bytes of
+ * data. Written as is (host byte order, no padding). Address is IPv6,
+ * IPv4 one is IPv4-mapped, unix sockets are all zeros */
+typedef struct {
+    uint64_t ts_us;                     // unix time
+    uint32_t len;
+    uint16_t client_port;
+    uint8_t event;                      // CAPTURE_*
+    uint8_t version;                    // CAPTURE_RECORD_VERSION
+    uint8_t client_addr[16];
+} capture_record_t;
+
+// client addresses to capture, prefix of IPv6 or IPv4-mapped address
+typedef struct {
+    uint8_t addr[16];
+    int len;                            // 0 matches everything
+} capture_filter_t;
+
+// "all" or IPv4/IPv6 address with optional /len, return -1 if invalid
+int capture_filter_parse(const char* str, capture_filter_t* filter);
+int capture_filter_match(const capture_filter_t* filter, const socket_t* sock);
+
+/* single-producer single-consumer ring of headers, worker tee()'s data
+ * to capture pipe and pushes header after it, writer thread writes
+ * header to file and splices len bytes of pipe after it */
+typedef struct {
+    capture_record_t* records;
+    size_t mask;
+    size_t head;                        // next position for worker
+    size_t tail;                        // next position for writer
+} capture_ring_t;
+
+typedef struct {
+    char path[PATH_MAX];
+    int fd;                             // opened on first record, -1 while closed
+    int failed;                         // records are discarded until capture is stopped
+} capture_file_t;
+
+inline static
+int capture_ring_init(capture_ring_t* ring, size_t size)
+{
+    // size must be power of 2
+    ring->records = (capture_record_t*) calloc(size, sizeof(capture_record_t));
+    if (!ring->records) return -1;
+
+    ring->mask = size - 1;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+inline static
+void capture_ring_free(capture_ring_t* ring)
+{
+    free(ring->records);
+    ring->records = NULL;
+}
+
+// return slot for next record or NULL if ring is full, capture_ring_commit() publishes it
+inline static
+capture_record_t* capture_ring_reserve(capture_ring_t* ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail > ring->mask) return NULL;
+    return &ring->records[ring->head & ring->mask];
+}
+
+inline static
+void capture_ring_commit(capture_ring_t* ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* write out records pushed to ring so far, return their count. Once
+ * ring is empty and capture is disabled file is closed and failure is
+ * forgotten, next record reopens (appends to) it */
+size_t capture_drain(capture_file_t* file, capture_ring_t* ring, int pipefd, int enabled);
+
+#endif
@@ -15,7 +15,13 @@
     "[%llu] [tid:%llu] [%s() %s:%d] " fmt "\n", \
     (unsigned long long) time(NULL), (unsigned long long) pthread_self(), __func__, __FILE__, __LINE__, ##arg
 
-#define INFO(fmt, arg...)       printf(FORMAT(fmt, ##arg))
+#define LOGLEVEL_ERROR 0
+#define LOGLEVEL_INFO  1
+
+// INFO() is printed only at LOGLEVEL_INFO, can be changed at runtime (admin socket)
+extern int gl_log_level;
+
+#define INFO(fmt, arg...)       (__atomic_load_n(&gl_log_level, __ATOMIC_RELAXED) >= LOGLEVEL_INFO ? printf(FORMAT(fmt, ##arg)) : 0)
 #define ERR(fmt, arg...)        printf(FORMAT(fmt, ##arg))
 #define ERRP(fmt, arg...)       printf(FORMAT(fmt ": %s", ##arg, errno ? strerror(errno) : "undefined error"))
 #define ERRN(fmt, sock, arg...) printf(FORMAT(fmt "[%s]: %s", ##arg, sock->to_string, errno ? strerror(errno) : "undefined error"))
@@ -17,6 +17,40 @@ typedef struct {
     size_t recv_size;
     size_t minconn;
     size_t maxconn;
+    int send_proxy;                     // PROXY_PROTOCOL_* header sent to upstream
+    int accept_proxy;                   // expect PROXY header from downstream
+    const char* tls_cert;               // terminate TLS on downstream if set
+    const char* tls_key;
+    size_t stats_interval;              // seconds between printing stats, 0 - never
+    size_t rate_conn;                   // bytes/sec per connection and direction, 0 - unlimited
+    size_t rate_ip;                     // bytes/sec per client address and direction (per worker)
+    size_t rate_global;                 // bytes/sec per direction, split evenly between workers
+    const char* acl_file;               // allow/deny rules for client addresses, reloaded on SIGHUP
+    size_t max_conn_per_ip;             // concurrent connections per client address (all workers), 0 - unlimited
+    size_t accept_rate_per_ip;          // new connections/sec per client address, 0 - unlimited
+    size_t quantum;                     // bytes read per connection and direction in one loop iteration, 0 - unlimited
+    size_t resolve_interval;            // seconds between resolving upstream again, 0 - resolve once at start
+    int udp;                            // relay UDP datagrams instead of TCP connections
+    int udp_gro;                        // receive coalesced datagrams (UDP_GRO), send them with UDP_SEGMENT
+    size_t udp_timeout;                 // seconds of inactivity after which UDP flow is closed
+    int transparent;                    // TRANSPARENT_* mode, upstream is original destination
+    int spoof_source;                   // connect to upstream from client's address (IP_TRANSPARENT)
+    int partition_ports;                // give each worker own slice of ephemeral ports (IP_LOCAL_PORT_RANGE)
+    int upstream_rst;                   // close upstream with RST instead of FIN, no TIME_WAIT
+    int fastopen;                       // TCP Fast Open on listener and upstream connections
+    size_t defer_accept;                // seconds kernel holds accepted connection until data arrives (TCP_DEFER_ACCEPT)
+    int lazy_connect;                   // connect to upstream only when client sends first bytes
+    size_t busy_poll;                   // usec of busy polling device queues (SO_BUSY_POLL, epoll), 0 - off
+    size_t busy_spin;                   // usec worker polls without blocking after last event, 0 - off
+    size_t collect_budget;              // usec, max io collect interval of adaptive batching, 0 - off
+    int rebalance;                      // hand accepted connections off to less loaded workers
+    int accept_model;                   // ACCEPT_* way workers get new connections
+    const char* access_log;             // file of binary per-connection records, NULL - off
+    size_t access_log_size;             // bytes after which access log is rotated, 0 - never
+    const char* capture;                // prefix of per-worker capture files, capture is toggled by SIGUSR2 or admin socket
+    const char* admin;                  // path of admin unix socket, NULL - off
+    size_t cpu_profile;                 // measure 1 of N connection callbacks with rdtsc, 0 - off
+    int loop_stats;                     // time loop iterations, poll and callbacks of every worker
 } GLOBAL;
 
 /* gl_settings should be initialized in thread-safe
@@ -0,0 +1,92 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "net.h"
+#include "common.h"
+
+/* bounded lock-free multi-producer single-consumer queue of accepted
+ * connections, which workers hand off to each other (D. Vyukov's bounded
+ * queue). Each slot has a sequence number: slot is free for producer
+ * which reserved position pos if seq == pos and holds data for consumer
+ * if seq == pos + 1. Producers reserve positions by CAS on head */
+
+typedef struct {
+    size_t seq;
+    int fd;
+    socket_t sock;
+} handoff_slot_t;
+
+typedef struct {
+    handoff_slot_t* slots;
+    size_t mask;
+    size_t head;                        // next position for producers
+    size_t tail;                        // next position for consumer
+} handoff_queue_t;
+
+inline static
+int handoff_init(handoff_queue_t* q, size_t size)
+{
+    // size must be power of 2
+    q->slots = (handoff_slot_t*) calloc(size, sizeof(handoff_slot_t));
+    if (!q->slots) return -1;
+
+    for (size_t i = 0; i < size; ++i)
+        q->slots[i].seq = i;
+
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+    return 0;
+}
+
+inline static
+void handoff_free(handoff_queue_t* q)
+{
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// return -1 if queue is full
+inline static
+int handoff_push(handoff_queue_t* q, int fd, const socket_t* sock)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    handoff_slot_t* slot;
+
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            // on failure pos is updated to current head
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1; // consumer hasn't taken slot from previous lap yet
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->fd = fd;
+    slot->sock = *sock;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// return 0 if queue is empty, called only by owner of queue
+inline static
+int handoff_pop(handoff_queue_t* q, int* fd, socket_t* sock)
+{
+    handoff_slot_t* slot = &q->slots[q->tail & q->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1)
+        return 0;
+
+    *fd = slot->fd;
+    *sock = slot->sock;
+    __atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+    q->tail++;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef __IP_TABLE_H__
+#define __IP_TABLE_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "net.h"
+#include "common.h"
+#include "token_bucket.h"
+
+/* per-worker table of client addresses. Open addressing with linear
+ * probing keeps entries in a single array (one cache line per lookup
+ * in common case), deletion is done by backward shifting so there are
+ * no tombstones. Entries move on insert/remove, don't keep pointers */
+
+typedef struct {
+    uint64_t hi, lo;                    // IPv6 address, IPv4 is mapped to ::ffff:0:0/96
+} ip_key_t;
+
+typedef struct {
+    ip_key_t key;
+    unsigned int used;                  // slot is occupied
+    unsigned int conns;                 // active connections from address
+    ev_tstamp last_seen;
+    token_bucket_t rate[2];             // bandwidth per direction
+    token_bucket_t accepts;             // new connections
+} ip_entry_t;
+
+typedef struct {
+    size_t size;                        // power of 2
+    size_t count;
+    ip_entry_t* entries;
+} ip_table_t;
+
+inline static
+ip_key_t ip_key_from_socket(const socket_t* sock)
+{
+    ip_key_t key = { 0, 0 };
+    const unsigned char* bytes = NULL;
+
+    if (sock->addr.ss_family == AF_INET6) {
+        bytes = ((const struct sockaddr_in6*) &sock->addr)->sin6_addr.s6_addr;
+        memcpy(&key.hi, bytes, 8);
+        memcpy(&key.lo, bytes + 8, 8);
+    } else if (sock->addr.ss_family == AF_INET) {
+        unsigned char mapped[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        memcpy(mapped + 12, &((const struct sockaddr_in*) &sock->addr)->sin_addr, 4);
+        memcpy(&key.hi, mapped, 8);
+        memcpy(&key.lo, mapped + 8, 8);
+    }
+
+    return key;
+}
+
+inline static
+unsigned int ip_key_port(const socket_t* sock)
+{
+    if (sock->addr.ss_family == AF_INET6) return ntohs(((const struct sockaddr_in6*) &sock->addr)->sin6_port);
+    if (sock->addr.ss_family == AF_INET) return ntohs(((const struct sockaddr_in*) &sock->addr)->sin_port);
+    return 0;
+}
+
+inline static
+uint64_t ip_key_hash(ip_key_t key)
+{
+    // murmur3 finalizer
+    uint64_t h = key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline static
+int ip_key_equal(ip_key_t a, ip_key_t b)
+{
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+inline static
+int ip_table_init(ip_table_t* t, size_t size)
+{
+    size_t pow2 = 16;
+    while (pow2 < size) pow2 <<= 1;
+
+    t->entries = calloc(pow2, sizeof(ip_entry_t));
+    if (!t->entries) return -1;
+
+    t->size = pow2;
+    t->count = 0;
+    return 0;
+}
+
+inline static
+void ip_table_free(ip_table_t* t)
+{
+    free(t->entries);
+    t->entries = NULL;
+    t->size = t->count = 0;
+}
+
+inline static
+ip_entry_t* ip_table_find(ip_table_t* t, ip_key_t key)
+{
+    size_t mask = t->size - 1;
+    for (size_t i = ip_key_hash(key) & mask; t->entries[i].used; i = (i + 1) & mask) {
+        if (ip_key_equal(t->entries[i].key, key))
+            return &t->entries[i];
+    }
+
+    return NULL;
+}
+
+inline static
+int ip_table_grow(ip_table_t* t)
+{
+    ip_table_t new_table;
+    if (ip_table_init(&new_table, t->size * 2))
+        return -1;
+
+    size_t mask = new_table.size - 1;
+    for (size_t i = 0; i < t->size; ++i) {
+        if (!t->entries[i].used) continue;
+
+        size_t j = ip_key_hash(t->entries[i].key) & mask;
+        while (new_table.entries[j].used) j = (j + 1) & mask;
+        new_table.entries[j] = t->entries[i];
+    }
+
+    new_table.count = t->count;
+    free(t->entries);
+    *t = new_table;
+    return 0;
+}
+
+// find entry or insert zeroed one, return NULL if failed to allocate memory
+inline static
+ip_entry_t* ip_table_insert(ip_table_t* t, ip_key_t key)
+{
+    ip_entry_t* e = ip_table_find(t, key);
+    if (e) return e;
+
+    // keep load factor below 1/2, probing sequences stay short
+    if ((t->count + 1) * 2 > t->size && ip_table_grow(t))
+        return NULL;
+
+    size_t mask = t->size - 1;
+    size_t i = ip_key_hash(key) & mask;
+    while (t->entries[i].used) i = (i + 1) & mask;
+
+    e = &t->entries[i];
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    e->used = 1;
+    t->count++;
+    return e;
+}
+
+inline static
+void ip_table_remove(ip_table_t* t, ip_entry_t* e)
+{
+    size_t mask = t->size - 1;
+    size_t i = e - t->entries;
+    assert(i < t->size && e->used);
+
+    // shift following entries of the cluster back if it brings them closer to home slot
+    for (size_t j = (i + 1) & mask; t->entries[j].used; j = (j + 1) & mask) {
+        size_t home = ip_key_hash(t->entries[j].key) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->entries[i] = t->entries[j];
+            i = j;
+        }
+    }
+
+    t->entries[i].used = 0;
+    t->count--;
+}
+
+// remove entries without connections not seen since given time
+inline static
+void ip_table_expire(ip_table_t* t, ev_tstamp seen_before)
+{
+    for (size_t i = 0; i < t->size; ) {
+        ip_entry_t* e = &t->entries[i];
+        if (e->used && !e->conns && e->last_seen < seen_before) {
+            ip_table_remove(t, e); // slot i is refilled by shifted entry, recheck it
+        } else {
+            ++i;
+        }
+    }
+}
+
+#endif
@@ -1,56 +1,224 @@
 #include <netdb.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "net.h"
 #include "common.h"
 #include "config.h"
 
-socket_t* socketize(const char* arg, int flags)
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80              // linux/netfilter_ipv4.h
+#endif
+
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST 80         // linux/netfilter_ipv6/ip6_tables.h
+#endif
+
+inline static
+char* _split_host_port(char* hostname, const char** port)
 {
-    assert(arg);
-    int ai_flags = flags & NET_SERVER_SOCKET ? AI_PASSIVE : 0;
+    // 'host:port' or '[ipv6]:port', modifies hostname in place and returns host
+    char* host = hostname;
+    char* colon = NULL;
 
-    char* hostname = strdup(arg);
-    socket_t* sock = malloc_or_die(sizeof(socket_t));
+    if (hostname[0] == '[') {
+        char* bracket = strchr(hostname, ']');
+        if (!bracket || bracket[1] != ':') ERRX("Unknown format for conf-string, ex: [::1]:6379");
 
-    char* colon = strrchr(hostname, ':');
-    if (!colon) ERRPX("Unknown format for conf-string, ex: localhost:6379");
+        *bracket = '\0';
+        host = hostname + 1;
+        colon = bracket + 1;
+    } else {
+        colon = strrchr(hostname, ':');
+        if (!colon) ERRX("Unknown format for conf-string, ex: localhost:6379");
+        if (memchr(hostname, ':', colon - hostname)) ERRX("IPv6 address must be in brackets, ex: [::1]:6379");
+    }
 
     *colon = '\0';
-    const char* port = colon + 1;
+    *port = colon + 1;
+    return host;
+}
+
+inline static
+int _busy_poll(int fd)
+{
+    int busy_poll = gl_settings.busy_poll, yes = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll))
+        || setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(yes));
+}
+
+inline static
+socket_set_t* _unix_socket_set(const char* path)
+{
+    // leading '@' stands for '\0' of abstract namespace
+    size_t len = strlen(path);
+    struct sockaddr_un un;
+
+    if (len == 0 || len >= sizeof(un.sun_path)) {
+        ERR("Invalid unix socket path '%s'", path);
+        return NULL;
+    }
+
+    socket_set_t* set = malloc_or_die(sizeof(socket_set_t) + sizeof(socket_t));
+    set->count = 1;
+    set->refs = 1;
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    memcpy(un.sun_path, path, len);
+
+    socket_t* sock = &set->socks[0];
+    sock->addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (path[0] == '@') {
+        un.sun_path[0] = '\0';
+    } else {
+        sock->addrlen += 1; // terminating '\0'
+    }
+
+    memset(&sock->addr, 0, sizeof(sock->addr));
+    memcpy(&sock->addr, &un, sizeof(un));
+    humanize_socket(sock);
+    return set;
+}
+
+socket_set_t* resolve_socket_set(const char* arg, int flags)
+{
+    assert(arg);
+
+    if (strncmp(arg, "unix:", 5) == 0)
+        return _unix_socket_set(arg + 5);
+    int server = flags & NET_SERVER_SOCKET;
+
+    char* hostname = strdup(arg);
+    const char* port = NULL;
+    const char* host = _split_host_port(hostname, &port);
+
+    // empty host or '*' is wildcard address
+    if (server && (host[0] == '\0' || strcmp(host, "*") == 0))
+        host = NULL;
 
     struct addrinfo hints, *result;
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_flags    = ai_flags;    /* For wildcard IP address */
-    hints.ai_family   = AF_INET;     //AF_UNSPEC;     /* Allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_STREAM; /* Stream socket */
-    hints.ai_protocol = IPPROTO_TCP; /* TPC protocol */
+    hints.ai_flags    = server ? AI_PASSIVE : 0; /* For wildcard IP address */
+    hints.ai_family   = AF_UNSPEC;               /* Allow IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_STREAM;             /* Stream socket */
+    hints.ai_protocol = IPPROTO_TCP;             /* TPC protocol */
+
+    int e = getaddrinfo(host, port, &hints, &result);
+    if (e) {
+        ERR("Failed to parse/resolve %s: %s", arg, gai_strerror(e));
+        free(hostname);
+        return NULL;
+    }
 
-    // FIXME do we need support of multihomed hosts???
-    int e = getaddrinfo(hostname, port, &hints, &result);
-    if (e) ERRX("Failed to parse/resolve %s: %s", hostname, gai_strerror(e));
+    size_t count = 0;
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next)
+        ++count;
 
-    assert(result);
-    assert(sizeof(sock->addr) >= result->ai_addrlen); // just in case ;-)
+    socket_set_t* set = malloc_or_die(sizeof(socket_set_t) + count * sizeof(socket_t));
+    set->count = 0;
+    set->refs = 1;
 
-    // TODO prefer IPv4 over IPv6 when both available
-    sock->addrlen = result->ai_addrlen;
-    memcpy(&sock->addr, result->ai_addr, result->ai_addrlen);
+    /* getaddrinfo() sorted addresses by preference (RFC 6724), keep it
+     * for the first one and then alternate families, so that if one of
+     * families is broken the next attempt is likely to succeed.
+     * Wildcard listener takes IPv6 to serve both families */
+    int family = result->ai_family;
+    if (server && !host) family = AF_INET6;
 
-    humanize_socket(sock);
-    INFO("socketize: %s -> %s", arg, sock->to_string);
+    while (set->count < count) {
+        struct addrinfo* ai = result;
+        for (; ai; ai = ai->ai_next)
+            if (ai->ai_family == family && ai->ai_addrlen) break;
+
+        if (!ai) // no more addresses of the family, take any
+            for (ai = result; ai && !ai->ai_addrlen; ai = ai->ai_next);
+
+        socket_t* sock = &set->socks[set->count++];
+        assert(sizeof(sock->addr) >= ai->ai_addrlen); // just in case ;-)
+        sock->addrlen = ai->ai_addrlen;
+        memcpy(&sock->addr, ai->ai_addr, ai->ai_addrlen);
+        humanize_socket(sock);
+
+        ai->ai_addrlen = 0; // mark as taken
+        family = family == AF_INET6 ? AF_INET : AF_INET6;
+    }
 
     freeaddrinfo(result);
     free(hostname);
+    return set;
+}
+
+socket_set_t* socketize_set(const char* arg, int flags)
+{
+    socket_set_t* set = resolve_socket_set(arg, flags);
+    if (!set) exit(EXIT_FAILURE);
+
+    for (size_t i = 0; i < set->count; ++i)
+        INFO("socketize: %s -> %s", arg, set->socks[i].to_string);
+
+    return set;
+}
+
+int socket_set_equal(const socket_set_t* a, const socket_set_t* b)
+{
+    // same addresses regardless of order
+    if (a->count != b->count) return 0;
+
+    for (size_t i = 0; i < a->count; ++i) {
+        size_t j = 0;
+        for (; j < b->count; ++j) {
+            if (a->socks[i].addrlen == b->socks[j].addrlen
+                && memcmp(&a->socks[i].addr, &b->socks[j].addr, a->socks[i].addrlen) == 0)
+                break;
+        }
+
+        if (j == b->count) return 0;
+    }
+
+    return 1;
+}
+
+socket_set_t* socket_set_ref(socket_set_t* set)
+{
+    __atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+    return set;
+}
+
+void socket_set_unref(socket_set_t* set)
+{
+    if (set && __atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(set);
+}
+
+socket_t* socketize(const char* arg, int flags)
+{
+    socket_set_t* set = socketize_set(arg, flags);
+    socket_t* sock = malloc_or_die(sizeof(socket_t));
+    *sock = set->socks[0];
+    socket_set_unref(set);
     return sock;
 }
 
 int setup_socket(const socket_t* sock, int flags)
 {
-    int fd = socket(sock->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    int family = sock->addr.ss_family;
+    int udp = flags & NET_UDP_SOCKET;
+    int fd = udp ? socket(family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)
+                 : socket(family, SOCK_STREAM | SOCK_NONBLOCK, family == AF_UNIX ? 0 : IPPROTO_TCP);
     if (fd < 0) {
         ERRP("Failed to create socket %s", sock->to_string);
         return -1;
@@ -62,12 +230,41 @@ int setup_socket(const socket_t* sock, int flags)
         goto error;
     }
 
+    if (flags & NET_TRANSPARENT_SOCKET) {
+        int yes = 1;
+        int ret = family == AF_INET6 ? setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &yes, sizeof(yes))
+                                     : setsockopt(fd, SOL_IP, IP_TRANSPARENT, &yes, sizeof(yes));
+        if (ret) {
+            ERRP("Failed to setsockopt IP_TRANSPARENT on %s (needs CAP_NET_ADMIN)", sock->to_string);
+            goto error;
+        }
+    }
+
     int recvbuf = gl_settings.recv_size;
     if (recvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &recvbuf, sizeof(recvbuf))) {
         ERRP("Failed to setsockopt SO_RCVBUF on %s", sock->to_string);
         goto error;
     }
 
+    /* poll device queue from the socket's own syscalls instead of waiting for interrupt.
+     * Permission is checked at start by check_busy_poll(), socket works without it anyway */
+    if (gl_settings.busy_poll && family != AF_UNIX && _busy_poll(fd))
+        ERRP("Failed to setsockopt SO_BUSY_POLL on %s, continue without it", sock->to_string);
+
+    /* TCP Fast Open (RFC 7413). Listener accepts data in SYN from clients
+     * having a cookie. Client socket's connect() returns right away if
+     * cookie for destination is known, SYN goes out with first written
+     * data then. Otherwise it's ordinary connect() which gets a cookie */
+    if ((flags & NET_FASTOPEN_SOCKET) && !udp && family != AF_UNIX) {
+        int qlen = SOMAXCONN, yes = 1;
+        int ret = (flags & NET_SERVER_SOCKET) ? setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen))
+                                              : setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes));
+        if (ret) {
+            ERRP("Failed to setsockopt TCP_FASTOPEN on %s", sock->to_string);
+            goto error;
+        }
+    }
+
     if (flags & NET_SERVER_SOCKET) {
         int yes = 1;
         if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
@@ -75,17 +272,42 @@ int setup_socket(const socket_t* sock, int flags)
             goto error;
         }
 
-        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+        // unix socket can't be bound twice, it's shared by workers instead
+        if (family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
             ERRP("Failed to setsockopt SO_REUSEPORT on %s", sock->to_string);
             goto error;
         }
 
+        // remove stale socket file left by previous run
+        const struct sockaddr_un* un = (const struct sockaddr_un*) &sock->addr;
+        if (family == AF_UNIX && un->sun_path[0] && unlink(un->sun_path) && errno != ENOENT) {
+            ERRP("Failed to unlink %s", sock->to_string);
+            goto error;
+        }
+
+        // wildcard IPv6 listener accepts IPv4 connections as well
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) &sock->addr;
+        if (sock->addr.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr)) {
+            int no = 0;
+            if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no))) {
+                ERRP("Failed to setsockopt IPV6_V6ONLY on %s", sock->to_string);
+                goto error;
+            }
+        }
+
         if (bind(fd, (struct sockaddr *) &sock->addr, sock->addrlen)) {
             ERRP("Failed to bind socket to %s", sock->to_string);
             goto error;
         }
 
-        if (listen(fd, SOMAXCONN)) {
+        // wake up accept() only once client has sent something
+        int defer = gl_settings.defer_accept;
+        if (defer && !udp && family != AF_UNIX && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer))) {
+            ERRP("Failed to setsockopt TCP_DEFER_ACCEPT on %s", sock->to_string);
+            goto error;
+        }
+
+        if (!udp && listen(fd, SOMAXCONN)) {
             ERRP("Failed to listen on socket %s", sock->to_string);
             goto error;
         }
@@ -111,7 +333,10 @@ int connect_client_socket(const socket_t* sock, int fd)
             } else if (errno == EINPROGRESS) {
                 return 0;
             } else {
+                // caller may look at errno
+                int err = errno;
                 ERRP("Failed to connect to %s", sock->to_string);
+                errno = err;
                 return -1;
             }
         }
@@ -123,10 +348,21 @@ int connect_client_socket(const socket_t* sock, int fd)
 void humanize_socket(socket_t* sock)
 {
     assert(sock);
-    assert(sock->addr.ss_family == AF_INET || sock->addr.ss_family == AF_INET6);
+    assert(sock->addr.ss_family == AF_INET || sock->addr.ss_family == AF_INET6 || sock->addr.ss_family == AF_UNIX);
 
-    char buf[24]; // SOCKET_STRING_SIZE - 8 (yes, this's magic number!)
-    if (sock->addr.ss_family == AF_INET) {
+    char buf[INET6_ADDRSTRLEN];
+    if (sock->addr.ss_family == AF_UNIX) {
+        // peers connected from unbound sockets have no address
+        struct sockaddr_un* un = (struct sockaddr_un*) &sock->addr;
+        size_t offset = offsetof(struct sockaddr_un, sun_path);
+        int len = sock->addrlen > offset ? sock->addrlen - offset : 0;
+
+        if (len && un->sun_path[0] == '\0') {
+            snprintf(sock->to_string, NET_SOCKET_STRING_SIZE, "unix:@%.*s", len - 1, un->sun_path + 1);
+        } else {
+            snprintf(sock->to_string, NET_SOCKET_STRING_SIZE, "unix:%.*s", len, un->sun_path);
+        }
+    } else if (sock->addr.ss_family == AF_INET) {
         struct sockaddr_in* in = (struct sockaddr_in*) &sock->addr;
         snprintf(sock->to_string,
                  NET_SOCKET_STRING_SIZE, "%s:%d",
@@ -140,3 +376,91 @@ void humanize_socket(socket_t* sock)
                  ntohs(in->sin6_port));
     }
 }
+
+void unmap_socket_v4(socket_t* sock)
+{
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*) &sock->addr;
+    if (sock->addr.ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+        return;
+
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = in6->sin6_port;
+    memcpy(&in.sin_addr, in6->sin6_addr.s6_addr + 12, 4);
+
+    memset(&sock->addr, 0, sizeof(sock->addr));
+    memcpy(&sock->addr, &in, sizeof(in));
+    sock->addrlen = sizeof(in);
+}
+
+int original_dst(int fd, socket_t* dst, int conntrack)
+{
+    memset(&dst->addr, 0, sizeof(dst->addr));
+    dst->addrlen = sizeof(dst->addr);
+    if (getsockname(fd, (struct sockaddr*) &dst->addr, &dst->addrlen)) {
+        ERRP("getsockname() failed");
+        return -1;
+    }
+
+    unmap_socket_v4(dst);
+
+    if (conntrack) {
+        int v6 = dst->addr.ss_family == AF_INET6;
+        struct sockaddr_storage orig;
+        socklen_t len = v6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        memset(&orig, 0, sizeof(orig));
+
+        int ret = v6 ? getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &orig, &len)
+                     : getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &orig, &len);
+        if (ret) {
+            // ENOENT: connection wasn't redirected
+            ERRP("Failed to get original destination");
+            return -1;
+        }
+
+        memcpy(&dst->addr, &orig, sizeof(orig));
+        dst->addrlen = len;
+    }
+
+    humanize_socket(dst);
+    return 0;
+}
+
+int local_address(const socket_t* sock)
+{
+    /* bind() without IP_FREEBIND succeeds only for addresses kernel
+     * considers local (with net.ipv4.ip_nonlocal_bind=1 for any of them) */
+    struct sockaddr_storage addr = sock->addr;
+    if (addr.ss_family == AF_INET) {
+        ((struct sockaddr_in*) &addr)->sin_port = 0;
+    } else if (addr.ss_family == AF_INET6) {
+        ((struct sockaddr_in6*) &addr)->sin6_port = 0;
+    } else {
+        return 1;
+    }
+
+    int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 1;
+
+    int ret = bind(fd, (struct sockaddr*) &addr, sock->addrlen);
+    int local = ret == 0 || errno != EADDRNOTAVAIL;
+    close(fd);
+    return local;
+}
+
+int check_busy_poll(void)
+{
+    // SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ERRP("Failed to create socket");
+        return -1;
+    }
+
+    int ret = _busy_poll(fd);
+    if (ret) ERRP("Failed to setsockopt SO_BUSY_POLL (needs CAP_NET_ADMIN)");
+
+    close(fd);
+    return ret ? -1 : 0;
+}
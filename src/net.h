@@ -4,7 +4,10 @@
 #include <sys/socket.h>
 
 #define NET_SERVER_SOCKET 0x1
-#define NET_SOCKET_STRING_SIZE 32
+#define NET_UDP_SOCKET    0x2           // datagram socket, server one is bound but not listening
+#define NET_TRANSPARENT_SOCKET 0x4      // IP_TRANSPARENT: accept any destination / bind to foreign address
+#define NET_FASTOPEN_SOCKET 0x8         // TCP Fast Open: accept / send data in SYN
+#define NET_SOCKET_STRING_SIZE 128 // "unix:" + sun_path, longer than "[" INET6_ADDRSTRLEN "]:65535"
 
 typedef struct {
     socklen_t addrlen;
@@ -12,10 +15,50 @@ typedef struct {
     char to_string[NET_SOCKET_STRING_SIZE];
 } socket_t;
 
-// turn string like 'localhost:1111' into socket_t structure
+// all addresses of a host, ordered for connection attempts
+typedef struct {
+    size_t count;
+    size_t refs;                        // reference counter, see socket_set_ref()
+    socket_t socks[];
+} socket_set_t;
+
+/* turn string like 'localhost:1111', '[::1]:1111' or '*:1111' into
+ * socket_t structure. For server sockets wildcard address means dual
+ * stack (IPv6 socket accepting IPv4 too) if host supports IPv6.
+ * 'unix:/path' is unix domain socket, 'unix:@name' is in abstract namespace */
 socket_t* socketize(const char* arg, int flags);
+
+/* same as socketize() but keep all resolved addresses,
+ * families are interleaved as RFC 8305 (Happy Eyeballs) suggests */
+socket_set_t* socketize_set(const char* arg, int flags);
+
+// same as socketize_set() but return NULL instead of exiting if failed
+socket_set_t* resolve_socket_set(const char* arg, int flags);
+
+// return 1 if sets contain same addresses (order doesn't matter)
+int socket_set_equal(const socket_set_t* a, const socket_set_t* b);
+
+/* sets shared between threads are reference counted,
+ * last socket_set_unref() frees the set. New set has refs = 1 */
+socket_set_t* socket_set_ref(socket_set_t* set);
+void socket_set_unref(socket_set_t* set);
 int setup_socket(const socket_t* sock, int flags);
+// return 1 if connected, 0 if in progress, -1 on error (errno is kept)
 int connect_client_socket(const socket_t* sock, int fd);
 void humanize_socket(socket_t* sock);
 
+/* original destination of accepted connection: from conntrack
+ * (iptables REDIRECT) if conntrack is set, otherwise local address
+ * of socket (TPROXY). IPv4-mapped addresses are turned into IPv4 */
+int original_dst(int fd, socket_t* dst, int conntrack);
+
+// turn ::ffff:a.b.c.d into a.b.c.d
+void unmap_socket_v4(socket_t* sock);
+
+// return 1 if address (port aside) is one of this host's, also if it can't be told
+int local_address(const socket_t* sock);
+
+// return 0 if sockets can be set up with --busy-poll, -1 otherwise
+int check_busy_poll(void);
+
 #endif
@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "proxy_protocol.h"
+
+static const char v2_signature[12] = "\r\n\r\n\0\r\nQUIT\n";
+
+#define V2_CMD_LOCAL  0x20
+#define V2_CMD_PROXY  0x21
+#define V2_FAM_TCP4   0x11
+#define V2_FAM_TCP6   0x21
+
+typedef struct {
+    char sig[12];
+    uint8_t ver_cmd;
+    uint8_t fam;
+    uint16_t len;
+} __attribute__((packed)) v2_header_t;
+
+inline static
+ssize_t build_v1(char* buf, size_t size, const socket_t* src, const socket_t* dst)
+{
+    char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+    int family = src->addr.ss_family;
+
+    if (family != dst->addr.ss_family || (family != AF_INET && family != AF_INET6)) {
+        return snprintf(buf, size, "PROXY UNKNOWN\r\n");
+    }
+
+    int sport, dport;
+    if (family == AF_INET) {
+        const struct sockaddr_in* s = (const struct sockaddr_in*) &src->addr;
+        const struct sockaddr_in* d = (const struct sockaddr_in*) &dst->addr;
+        inet_ntop(AF_INET, &s->sin_addr, saddr, sizeof(saddr));
+        inet_ntop(AF_INET, &d->sin_addr, daddr, sizeof(daddr));
+        sport = ntohs(s->sin_port);
+        dport = ntohs(d->sin_port);
+    } else {
+        const struct sockaddr_in6* s = (const struct sockaddr_in6*) &src->addr;
+        const struct sockaddr_in6* d = (const struct sockaddr_in6*) &dst->addr;
+        inet_ntop(AF_INET6, &s->sin6_addr, saddr, sizeof(saddr));
+        inet_ntop(AF_INET6, &d->sin6_addr, daddr, sizeof(daddr));
+        sport = ntohs(s->sin6_port);
+        dport = ntohs(d->sin6_port);
+    }
+
+    return snprintf(buf, size, "PROXY %s %s %s %d %d\r\n",
+                    family == AF_INET ? "TCP4" : "TCP6",
+                    saddr, daddr, sport, dport);
+}
+
+inline static
+ssize_t build_v2(char* buf, size_t size, const socket_t* src, const socket_t* dst)
+{
+    v2_header_t* hdr = (v2_header_t*) buf;
+    char* payload = buf + sizeof(v2_header_t);
+    int family = src->addr.ss_family;
+    size_t len = 0;
+
+    assert(size >= sizeof(v2_header_t) + 36);
+    memcpy(hdr->sig, v2_signature, sizeof(hdr->sig));
+    hdr->ver_cmd = V2_CMD_PROXY;
+
+    if (family == AF_INET && dst->addr.ss_family == AF_INET) {
+        const struct sockaddr_in* s = (const struct sockaddr_in*) &src->addr;
+        const struct sockaddr_in* d = (const struct sockaddr_in*) &dst->addr;
+        hdr->fam = V2_FAM_TCP4;
+        memcpy(payload + 0, &s->sin_addr, 4);
+        memcpy(payload + 4, &d->sin_addr, 4);
+        memcpy(payload + 8, &s->sin_port, 2);
+        memcpy(payload + 10, &d->sin_port, 2);
+        len = 12;
+    } else if (family == AF_INET6 && dst->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* s = (const struct sockaddr_in6*) &src->addr;
+        const struct sockaddr_in6* d = (const struct sockaddr_in6*) &dst->addr;
+        hdr->fam = V2_FAM_TCP6;
+        memcpy(payload + 0, &s->sin6_addr, 16);
+        memcpy(payload + 16, &d->sin6_addr, 16);
+        memcpy(payload + 32, &s->sin6_port, 2);
+        memcpy(payload + 34, &d->sin6_port, 2);
+        len = 36;
+    } else {
+        // LOCAL command, receiver must use real connection endpoints
+        hdr->ver_cmd = V2_CMD_LOCAL;
+        hdr->fam = 0;
+    }
+
+    hdr->len = htons(len);
+    return sizeof(v2_header_t) + len;
+}
+
+inline static
+ssize_t parse_v1(const char* buf, size_t size, socket_t* src)
+{
+    const char* end = memchr(buf, '\n', size < 107 ? size : 107);
+    if (!end) return size < 107 ? 0 : -1;
+    if (end == buf || end[-1] != '\r') return -1;
+
+    char line[108];
+    size_t len = end - buf + 1;
+    memcpy(line, buf, len - 2);
+    line[len - 2] = '\0';
+
+    char proto[8], saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+    unsigned int sport, dport;
+
+    if (strncmp(line, "PROXY UNKNOWN", 13) == 0)
+        return len;
+
+    if (sscanf(line, "PROXY %7s %45s %45s %u %u", proto, saddr, daddr, &sport, &dport) != 5)
+        return -1;
+
+    if (sport > 65535 || dport > 65535)
+        return -1;
+
+    if (strcmp(proto, "TCP4") == 0) {
+        struct sockaddr_in* in = (struct sockaddr_in*) &src->addr;
+        memset(in, 0, sizeof(*in));
+        if (inet_pton(AF_INET, saddr, &in->sin_addr) != 1) return -1;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(sport);
+        src->addrlen = sizeof(struct sockaddr_in);
+    } else if (strcmp(proto, "TCP6") == 0) {
+        struct sockaddr_in6* in = (struct sockaddr_in6*) &src->addr;
+        memset(in, 0, sizeof(*in));
+        if (inet_pton(AF_INET6, saddr, &in->sin6_addr) != 1) return -1;
+        in->sin6_family = AF_INET6;
+        in->sin6_port = htons(sport);
+        src->addrlen = sizeof(struct sockaddr_in6);
+    } else {
+        return -1;
+    }
+
+    return len;
+}
+
+inline static
+ssize_t parse_v2(const char* buf, size_t size, socket_t* src)
+{
+    if (size < sizeof(v2_header_t)) return 0;
+
+    const v2_header_t* hdr = (const v2_header_t*) buf;
+    const char* payload = buf + sizeof(v2_header_t);
+    size_t len = sizeof(v2_header_t) + ntohs(hdr->len);
+
+    if ((hdr->ver_cmd & 0xF0) != 0x20) return -1;
+    if (len > PROXY_PROTOCOL_MAX_INPUT_SIZE) return -1;
+    if (size < len) return 0;
+
+    if (hdr->ver_cmd == V2_CMD_LOCAL) return len;
+    if (hdr->ver_cmd != V2_CMD_PROXY) return -1;
+
+    if (hdr->fam == V2_FAM_TCP4 && len >= sizeof(v2_header_t) + 12) {
+        struct sockaddr_in* in = (struct sockaddr_in*) &src->addr;
+        memset(in, 0, sizeof(*in));
+        in->sin_family = AF_INET;
+        memcpy(&in->sin_addr, payload + 0, 4);
+        memcpy(&in->sin_port, payload + 8, 2);
+        src->addrlen = sizeof(struct sockaddr_in);
+    } else if (hdr->fam == V2_FAM_TCP6 && len >= sizeof(v2_header_t) + 36) {
+        struct sockaddr_in6* in = (struct sockaddr_in6*) &src->addr;
+        memset(in, 0, sizeof(*in));
+        in->sin6_family = AF_INET6;
+        memcpy(&in->sin6_addr, payload + 0, 16);
+        memcpy(&in->sin6_port, payload + 32, 2);
+        src->addrlen = sizeof(struct sockaddr_in6);
+    }
+
+    // other families (UDP, UNIX, UNSPEC) are accepted but addresses ignored
+    return len;
+}
+
+ssize_t parse_proxy_header(const char* buf, size_t size, socket_t* src)
+{
+    assert(buf);
+    assert(src);
+
+    // compare as much of signature as we have so far
+    size_t cmp = size < sizeof(v2_signature) ? size : sizeof(v2_signature);
+    if (memcmp(buf, v2_signature, cmp) == 0)
+        return size < sizeof(v2_signature) ? 0 : parse_v2(buf, size, src);
+
+    cmp = size < 6 ? size : 6;
+    if (memcmp(buf, "PROXY ", cmp) == 0)
+        return size < 6 ? 0 : parse_v1(buf, size, src);
+
+    return -1;
+}
+
+ssize_t build_proxy_header(char* buf, size_t size, int version,
+                           const socket_t* src, const socket_t* dst)
+{
+    assert(buf);
+    assert(src);
+    assert(dst);
+    assert(size >= PROXY_PROTOCOL_MAX_HEADER_SIZE);
+
+    switch (version) {
+        case PROXY_PROTOCOL_V1: return build_v1(buf, size, src, dst);
+        case PROXY_PROTOCOL_V2: return build_v2(buf, size, src, dst);
+    }
+
+    return -1;
+}
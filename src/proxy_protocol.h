@@ -0,0 +1,29 @@
+#ifndef __PROXY_PROTOCOL_H__
+#define __PROXY_PROTOCOL_H__
+
+#include <sys/types.h>
+#include "net.h"
+
+#define PROXY_PROTOCOL_NONE 0
+#define PROXY_PROTOCOL_V1   1
+#define PROXY_PROTOCOL_V2   2
+
+// v1 header is at most 107 bytes, v2 with TCP6 addresses is 52 bytes
+#define PROXY_PROTOCOL_MAX_HEADER_SIZE 108
+
+// largest incoming header (v2 with TLVs) we agree to consume
+#define PROXY_PROTOCOL_MAX_INPUT_SIZE 536
+
+/* build PROXY protocol header describing connection from src to dst.
+ * If addresses can't be represented UNKNOWN (v1) or LOCAL (v2) header
+ * is built. Return size of header written to buf or -1 for bad version */
+ssize_t build_proxy_header(char* buf, size_t size, int version,
+                           const socket_t* src, const socket_t* dst);
+
+/* parse v1 or v2 header at the beginning of buf.
+ * return header length if header is complete, 0 if more data is needed
+ * and -1 if data is not a valid PROXY header. src is filled only if
+ * header carries TCP4/TCP6 addresses (i.e. not LOCAL/UNKNOWN) */
+ssize_t parse_proxy_header(const char* buf, size_t size, socket_t* src);
+
+#endif
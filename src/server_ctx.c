@@ -1,25 +1,146 @@
 #define _GNU_SOURCE         /* See feature_test_macros(7) */
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <linux/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "common.h"
 #include "config.h"
 #include "server_ctx.h"
+#include "proxy_protocol.h"
+#include "sketch.h"
 
 #define EV_DIRECT_CALL     (1<<31)
+#define EV_DEFERRED_CALL   (1<<30)
+#define EV_PROFILED_CALL   (1<<29)
 #define MAX_SPLICE_AT_ONCE (1<<30)
+#define RATE_MIN_CHUNK     4096  // don't wake up for less than this amount of tokens
+#define CONNECTION_ATTEMPT_DELAY 0.25 // RFC 8305 recommends 250ms
+#define FASTOPEN_DATA_WAIT 0.01 // how long fast open SYN waits for client's first bytes
+#define COLLECT_TUNE_PERIOD 0.1
+#define COLLECT_MIN_WAKEUPS 100 // per tune period, don't delay anything below 1000 wakeups/s
+#define COLLECT_TARGET_EVENTS 8 // events per wakeup adaptive batching aims for
+#define COLLECT_STEP 0.00005    // smallest non-zero io collect interval
+#define COLLECT_HOLD 10         // tune periods to stay at zero interval after batching didn't help
+#define HANDOFF_QUEUE_SIZE 1024 // power of 2
+#define REBALANCE_WINDOW 0.1    // period of measuring loop busy time
+#define REBALANCE_SLACK 8       // load difference worth handing connection off
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
+#ifndef EPIOCSPARAMS
+// Linux 6.9+, older headers don't have it
+struct epoll_params {
+    __u32 busy_poll_usecs;
+    __u16 busy_poll_budget;
+    __u8 prefer_busy_poll;
+    __u8 __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// concurrent connections per client address, shared by all workers
+static count_sketch_t g_conns_per_ip;
+
+// all workers, see set_server_ctxs()
+static server_ctx_t* g_sctxs = NULL;
+static size_t g_sctxs_count = 0;
 
 inline static void accept_cb(struct ev_loop* loop, ev_io* w, int revents);
 inline static void stop_loop_cb(struct ev_loop* loop, ev_async* w, int revents);
+inline static void wakeup_cb(struct ev_loop* loop, ev_async* w, int revents);
+inline static void quiescent_cb(struct ev_loop* loop, ev_prepare* w, int revents);
 
 inline static void connect_cb(struct ev_loop* loop, ev_io* w, int revents);
+inline static void stagger_cb(struct ev_loop* loop, ev_timer* w, int revents);
 inline static void upstream_cb(struct ev_loop* loop, ev_io* w, int revents);
 inline static void downstream_cb(struct ev_loop* loop, ev_io* w, int revents);
+inline static void mirror_cb(struct ev_loop* loop, ev_io* w, int revents);
+inline static void throttle_cb(struct ev_loop* loop, ev_timer* w, int revents);
+inline static void expire_clients_cb(struct ev_loop* loop, ev_timer* w, int revents);
+inline static void deferred_check_cb(struct ev_loop* loop, ev_check* w, int revents);
+inline static void deferred_idle_cb(struct ev_loop* loop, ev_idle* w, int revents);
+inline static void busy_check_cb(struct ev_loop* loop, ev_check* w, int revents);
+inline static void collect_check_cb(struct ev_loop* loop, ev_check* w, int revents);
+inline static void collect_tune_cb(struct ev_loop* loop, ev_timer* w, int revents);
+inline static void handoff_cb(struct ev_loop* loop, ev_async* w, int revents);
+inline static void rebalance_prepare_cb(struct ev_loop* loop, ev_prepare* w, int revents);
+inline static void rebalance_check_cb(struct ev_loop* loop, ev_check* w, int revents);
+inline static void capture_cb(struct ev_loop* loop, ev_async* w, int revents);
+inline static void admin_cb(struct ev_loop* loop, ev_async* w, int revents);
+inline static void loop_prepare_cb(struct ev_loop* loop, ev_prepare* w, int revents);
+inline static void loop_check_cb(struct ev_loop* loop, ev_check* w, int revents);
+inline static void loop_lag_cb(struct ev_loop* loop, ev_timer* w, int revents);
 
 inline static int grow_pool(server_ctx_t* sctx, size_t size);
+inline static void _add_client(server_ctx_t* sctx, client_ctx_t* cctx, int fd);
+inline static size_t _load(server_ctx_t* sctx);
+inline static int _handoff(server_ctx_t* sctx, int fd, const socket_t* sock);
 inline static client_ctx_t* _get_client_ctx(server_ctx_t* sctx);
 inline static void _mark_client_ctx_as_used(server_ctx_t* sctx, client_ctx_t* cctx);
 inline static void _mark_client_ctx_as_free(server_ctx_t* sctx, client_ctx_t* cctx);
 inline static void _reset_events_mask(struct ev_loop* loop, ev_io* io, int events);
+inline static void _epoll_busy_poll(int epfd);
+inline static socket_set_t* _original_dst(server_ctx_t* sctx, int fd);
+inline static int _next_source(server_ctx_t* sctx, const socket_t* dst, socket_t* src);
+inline static int _bind_upstream(server_ctx_t* sctx, client_ctx_t* cctx, int fd, const socket_t* sock);
+inline static void _close_upstream(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static int _tcp_info(int fd, struct tcp_info* info);
+inline static int _connect_upstream(server_ctx_t* sctx, client_ctx_t* cctx, int fd);
+inline static int _start_connect(server_ctx_t* sctx, client_ctx_t* cctx, ev_io* w);
+inline static void _stop_connect(server_ctx_t* sctx, ev_io* w);
+inline static int _send_proxy_header(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static int _recv_proxy_header(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static ssize_t _splice_from_downstream(server_ctx_t* sctx, client_ctx_t* cctx, size_t len);
+inline static ssize_t _splice_to_downstream(client_ctx_t* cctx, size_t len);
+inline static int _downstream_input_pending(client_ctx_t* cctx);
+inline static void _init_mirror(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static void _stop_mirror(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static size_t _rate_quota(server_ctx_t* sctx, client_ctx_t* cctx, int dir);
+inline static size_t _global_rate_share();
+inline static void _rate_consume(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t amount);
+inline static int _ip_tracking_enabled();
+inline static ip_entry_t* _get_ip_entry(server_ctx_t* sctx, ip_key_t key);
+inline static int _admit_client(server_ctx_t* sctx, const socket_t* sock);
+inline static void _set_rst_on_close(int fd);
+inline static void _track_client(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static void _untrack_client(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static size_t _quantum_quota(server_ctx_t* sctx, client_ctx_t* cctx, int dir, int revents, size_t quota);
+inline static int _quantum_consume(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t amount);
+inline static void _defer(server_ctx_t* sctx, client_ctx_t* cctx, int flag);
+inline static void _undefer(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static void _log_access(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static void _capture_start(server_ctx_t* sctx);
+inline static void _capture_stop(server_ctx_t* sctx);
+inline static void _capture_client(server_ctx_t* sctx, client_ctx_t* cctx);
+inline static capture_record_t* _capture_record(server_ctx_t* sctx, client_ctx_t* cctx, int event);
+inline static void _capture_event(server_ctx_t* sctx, client_ctx_t* cctx, int event);
+inline static size_t _capture(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t len);
+inline static void _captured(client_ctx_t* cctx, int dir, size_t len);
+inline static void _admin_conns(server_ctx_t* sctx, FILE* out);
+inline static void _admin_kill(server_ctx_t* sctx, size_t idx, FILE* out);
+inline static void _admin_drain(server_ctx_t* sctx, const socket_set_t* set, int drain, FILE* out);
+inline static int _drained(server_ctx_t* sctx, const socket_t* sock);
+inline static uint64_t _cycles();
+inline static int _profile_sample(server_ctx_t* sctx);
+inline static void _profile_add(server_ctx_t* sctx, client_ctx_t* cctx, uint64_t cycles);
+inline static profile_route_t* _profile_route(profile_route_t* routes, size_t* count, const socket_t* sock);
+inline static void _admin_profile(server_ctx_t* sctx, size_t top, FILE* out);
+inline static size_t _pending_events(server_ctx_t* sctx);
+inline static void _loop_hist_add(loop_hist_t* hist, size_t val);
+inline static void _admin_loop(server_ctx_t* sctx, FILE* out);
 
 /******************************************************************
  * functions for accepting TCP connections (i.e. server routines) *
@@ -39,21 +160,33 @@ void accept_cb(struct ev_loop* loop, ev_io* w, int revents)
 
     socket_t* sock = &cctx->downstream.sock;
     sock->addrlen = sizeof(sock->addr);
-    fd = accept(w->fd, (struct sockaddr*) &sock->addr, &sock->addrlen);
+    fd = accept4(w->fd, (struct sockaddr*) &sock->addr, &sock->addrlen, SOCK_NONBLOCK);
 
     if (fd >= 0) {
-        humanize_socket(sock);
-        if (init_client_ctx(sctx, cctx, fd))
-            goto error;
+        // with PROXY protocol peer is a load balancer, client is checked once header is read
+        if (!gl_settings.accept_proxy && _admit_client(sctx, sock)) {
+            _set_rst_on_close(fd);
+            close(fd);
+            return;
+        }
 
-        _mark_client_ctx_as_used(sctx, cctx);
-        _D("assigned idx %d to client_ctx_t for %s", cctx->idx, sock->to_string);
+        struct tcp_info info;
+        if (gl_settings.fastopen && !_tcp_info(fd, &info) && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+            STAT_ADD(&sctx->stats, fastopen_accepted, 1);
 
-        INFO("accepted connection from %s", sock->to_string);
+        if (gl_settings.rebalance && _handoff(sctx, fd, sock) == 0)
+            return;
+
+        _add_client(sctx, cctx, fd);
     } else {
         switch (errno) {
-            case EINTR:
             case EAGAIN:
+                // shared listener wakes up all idle workers, one of them gets connection
+                if (gl_settings.accept_model == ACCEPT_SHARED)
+                    STAT_ADD(&sctx->stats, accept_races, 1);
+                break;
+
+            case EINTR:
             case ECONNABORTED:
                 break; // noop
 
@@ -96,28 +229,415 @@ void stop_loop_cb(struct ev_loop* loop, ev_async* w, int revents) {
     ev_break(loop, EVBREAK_ALL);
 }
 
-int init_server_ctx(server_ctx_t* sctx, const socket_t* ssock, const socket_t* usock)
+inline static
+void wakeup_cb(struct ev_loop* loop, ev_async* w, int revents)
+{
+    // noop, loop iteration itself is what main thread waits for
+}
+
+inline static
+void quiescent_cb(struct ev_loop* loop, ev_prepare* w, int revents)
+{
+    /* all callbacks of iteration are done, none of them keeps pointer
+     * to acl or upstream addresses (without taking a reference) which
+     * main or resolver thread could swap meanwhile */
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    __atomic_store_n(&sctx->epoch, sctx->epoch + 1, __ATOMIC_RELEASE);
+}
+
+inline static
+void handoff_cb(struct ev_loop* loop, ev_async* w, int revents)
+{
+    // take connections other workers accepted for us
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    socket_t sock;
+    int fd;
+
+    while (handoff_pop(&sctx->rebalance.queue, &fd, &sock)) {
+        STAT_ADD(&sctx->stats, handoffs_in, 1);
+
+        client_ctx_t* cctx = _get_client_ctx(sctx);
+        if (!cctx) {
+            INFO("limit of max connections reached");
+            close(fd);
+            continue;
+        }
+
+        cctx->downstream.sock = sock;
+        _add_client(sctx, cctx, fd);
+    }
+}
+
+inline static
+void rebalance_prepare_cb(struct ev_loop* loop, ev_prepare* w, int revents)
+{
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    sctx->rebalance.poll_start = ev_time();
+}
+
+inline static
+void rebalance_check_cb(struct ev_loop* loop, ev_check* w, int revents)
+{
+    // publish share of time loop spent doing work, other workers read it in _load()
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    struct rebalance* r = &sctx->rebalance;
+    ev_tstamp now = ev_now(loop);
+
+    if (now > r->poll_start) r->blocked += now - r->poll_start;
+
+    ev_tstamp window = now - r->window_start;
+    if (window < REBALANCE_WINDOW) return;
+
+    size_t busy = r->blocked < window ? (size_t) (1000 * (1 - r->blocked / window)) : 0;
+    STAT_SET(&sctx->stats, loop_busy_permille, busy);
+    r->window_start = now;
+    r->blocked = 0;
+}
+
+inline static
+void capture_cb(struct ev_loop* loop, ev_async* w, int revents)
+{
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    int enabled = __atomic_load_n(&sctx->capture.enabled, __ATOMIC_ACQUIRE);
+
+    if (enabled && !sctx->capture.active) {
+        _capture_start(sctx);
+    } else if (!enabled && sctx->capture.active) {
+        _capture_stop(sctx);
+    }
+}
+
+inline static
+void admin_cb(struct ev_loop* loop, ev_async* w, int revents)
+{
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    admin_msg_t* msg = __atomic_exchange_n(&sctx->admin.msg, NULL, __ATOMIC_ACQ_REL);
+    if (!msg) return;
+
+    FILE* out = open_memstream(&msg->reply, &msg->reply_len);
+    if (!out) {
+        ERRP("Failed to open memory stream for admin reply");
+        __atomic_store_n(&msg->done, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    switch (msg->cmd) {
+        case ADMIN_CONNS:
+            _admin_conns(sctx, out);
+            break;
+
+        case ADMIN_KILL:
+            _admin_kill(sctx, msg->idx, out);
+            break;
+
+        case ADMIN_DRAIN:
+        case ADMIN_UNDRAIN:
+            _admin_drain(sctx, msg->set, msg->cmd == ADMIN_DRAIN, out);
+            break;
+
+        case ADMIN_CAPTURE:
+            // new filter applies to connections which are already established too
+            if (sctx->capture.active) _capture_stop(sctx);
+            sctx->capture.filter = msg->filter;
+            __atomic_store_n(&sctx->capture.enabled, msg->enable, __ATOMIC_RELEASE);
+            if (msg->enable) _capture_start(sctx);
+            fprintf(out, "worker=%zu capture=%s\n", sctx->worker, sctx->capture.active ? "on" : "off");
+            break;
+
+        case ADMIN_PROFILE:
+            _admin_profile(sctx, msg->idx, out);
+            break;
+
+        case ADMIN_LOOP:
+            _admin_loop(sctx, out);
+            break;
+    }
+
+    fclose(out);
+    __atomic_store_n(&msg->done, 1, __ATOMIC_RELEASE);
+}
+
+inline static
+void loop_prepare_cb(struct ev_loop* loop, ev_prepare* w, int revents)
+{
+    // previous iteration ends here, its callbacks are done
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    struct loop_stats* ls = &sctx->loop_stats;
+    ev_tstamp now = ev_time();
+
+    if (ls->poll_end) {
+        ev_tstamp callbacks = now > ls->poll_end ? now - ls->poll_end : 0;
+        ev_tstamp iteration = now > ls->poll_start ? now - ls->poll_start : 0;
+
+        ls->callbacks += callbacks;
+        _loop_hist_add(&ls->callbacks_us, (size_t) (callbacks * 1e6));
+        _loop_hist_add(&ls->iteration_us, (size_t) (iteration * 1e6));
+        STAT_SET(&sctx->stats, loop_callbacks_us, (size_t) (ls->callbacks * 1e6));
+        STAT_ADD(&sctx->stats, loop_iterations, 1);
+    }
+
+    ls->poll_start = now;
+}
+
+inline static
+void loop_check_cb(struct ev_loop* loop, ev_check* w, int revents)
+{
+    // check watchers run first, all events found by this iteration are still pending
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    struct loop_stats* ls = &sctx->loop_stats;
+    ev_tstamp now = ev_time();
+    ev_tstamp blocked = now > ls->poll_start ? now - ls->poll_start : 0;
+
+    ls->poll_end = now;
+    ls->blocked += blocked;
+    _loop_hist_add(&ls->blocked_us, (size_t) (blocked * 1e6));
+    _loop_hist_add(&ls->events, _pending_events(sctx));
+    STAT_SET(&sctx->stats, loop_blocked_us, (size_t) (ls->blocked * 1e6));
+}
+
+inline static
+void loop_lag_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    /* timer is due at lag_due, but loop notices it only after poll
+     * returns and runs it among other callbacks. The difference is
+     * lag every timer, including connection timeouts, suffers */
+
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    struct loop_stats* ls = &sctx->loop_stats;
+    ev_tstamp now = ev_time();
+    size_t lag = now > ls->lag_due ? (size_t) ((now - ls->lag_due) * 1e6) : 0;
+
+    _loop_hist_add(&ls->lag_us, lag);
+    STAT_SET(&sctx->stats, loop_lag_us, lag);
+
+    ev_timer_set(w, LOOP_LAG_INTERVAL, 0.);
+    ev_timer_start(loop, w);
+    ls->lag_due = ev_now(loop) + LOOP_LAG_INTERVAL;
+}
+
+inline static
+void expire_clients_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    ip_table_expire(&sctx->clients, ev_now(loop) - w->repeat);
+}
+
+inline static
+void deferred_check_cb(struct ev_loop* loop, ev_check* w, int revents)
+{
+    /* one round of deficit round robin: every connection which
+     * was in the list when the round started reads one more quantum.
+     * Connections deferred during the round wait for the next one */
+
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    size_t round = sctx->deferred.count;
+
+    while (round-- && sctx->deferred.head >= 0) {
+        client_ctx_t* cctx = &sctx->pool[sctx->deferred.head];
+        int flags = cctx->flags & (CLIENT_DEFERRED_UPSTREAM | CLIENT_DEFERRED_DOWNSTREAM);
+        _undefer(sctx, cctx);
+
+        if (flags & CLIENT_DEFERRED_DOWNSTREAM) {
+            cctx->deficit[DIR_TO_UPSTREAM] += gl_settings.quantum;
+            downstream_cb(loop, &cctx->downstream.io, EV_DEFERRED_CALL | EV_READ);
+        }
+
+        // previous callback could close connection
+        if ((flags & CLIENT_DEFERRED_UPSTREAM) && cctx->upstream.io.fd >= 0) {
+            cctx->deficit[DIR_TO_DOWNSTREAM] += gl_settings.quantum;
+            upstream_cb(loop, &cctx->upstream.io, EV_DEFERRED_CALL | EV_READ);
+        }
+    }
+
+    if (!sctx->deferred.count)
+        ev_idle_stop(loop, &sctx->deferred.idle);
+}
+
+inline static
+void deferred_idle_cb(struct ev_loop* loop, ev_idle* w, int revents)
+{
+    // noop, active idle watcher makes loop poll without blocking
+}
+
+inline static
+void busy_check_cb(struct ev_loop* loop, ev_check* w, int revents)
+{
+    /* --busy-spin: keep polling without blocking while events keep
+     * coming, block again once there were none for busy_spin usec.
+     * Idle watchers are queued only if nothing else is pending, so
+     * pending spin watcher means this iteration found no work */
+
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    ev_tstamp now = ev_now(loop);
+    int work = !ev_is_pending(&sctx->busy.spin);
+
+    if (ev_is_active(&sctx->busy.spin)) {
+        if (work) {
+            sctx->busy.last_work = now;
+            STAT_ADD(&sctx->stats, spin_work, 1);
+        } else {
+            sctx->busy.empty += now - sctx->busy.last_check;
+            STAT_SET(&sctx->stats, spin_empty_us, (size_t) (sctx->busy.empty * 1e6));
+
+            if (now - sctx->busy.last_work > gl_settings.busy_spin / 1e6) {
+                ev_idle_stop(loop, &sctx->busy.spin);
+                STAT_ADD(&sctx->stats, spin_sleeps, 1);
+            }
+        }
+    } else if (work) {
+        // woken up by an event, traffic is likely to follow
+        sctx->busy.last_work = now;
+        ev_idle_start(loop, &sctx->busy.spin);
+    }
+
+    sctx->busy.last_check = now;
+}
+
+inline static
+void collect_check_cb(struct ev_loop* loop, ev_check* w, int revents)
+{
+    // check watchers run first, all events found by this iteration are still pending
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    size_t events = _pending_events(sctx);
+    if (!events) return;
+
+    sctx->collect.wakeups++;
+    sctx->collect.events += events;
+    STAT_ADD(&sctx->stats, loop_wakeups, 1);
+    STAT_ADD(&sctx->stats, loop_events, events);
+}
+
+inline static
+void collect_tune_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    /* few events per wakeup at high wakeup rate means loop overhead
+     * dominates: let events accumulate longer before polling, up to
+     * --collect-budget. Back off once batches are large or load drops.
+     * If waiting longer didn't make batches larger, clients are waiting
+     * for replies (latency bound) and delay only slows them down */
+
+    server_ctx_t* sctx = (server_ctx_t*) w->data;
+    struct collect* c = &sctx->collect;
+    ev_tstamp budget = gl_settings.collect_budget / 1e6;
+    double batch = c->wakeups ? (double) c->events / c->wakeups : 0;
+
+    if (c->hold) c->hold--;
+
+    if (c->wakeups < COLLECT_MIN_WAKEUPS) {
+        c->interval = 0;
+    } else if (batch < COLLECT_TARGET_EVENTS) {
+        if (c->interval && batch < c->batch * 1.25) {
+            c->interval = 0;
+            c->hold = COLLECT_HOLD;
+        } else if (!c->hold) {
+            c->interval = c->interval ? c->interval * 2 : COLLECT_STEP;
+            if (c->interval > budget) c->interval = budget;
+        }
+    } else if (batch > COLLECT_TARGET_EVENTS * 2) {
+        c->interval /= 2;
+        if (c->interval < COLLECT_STEP) c->interval = 0;
+    }
+
+    c->batch = batch;
+
+    ev_set_io_collect_interval(loop, c->interval);
+    STAT_SET(&sctx->stats, io_collect_us, (size_t) (c->interval * 1e6));
+    c->wakeups = c->events = 0;
+}
+
+int setup_server_socket(const socket_t* ssock)
+{
+    int flags = NET_SERVER_SOCKET
+              | (gl_settings.udp ? NET_UDP_SOCKET : 0)
+              | (gl_settings.transparent == TRANSPARENT_TPROXY ? NET_TRANSPARENT_SOCKET : 0)
+              | (gl_settings.fastopen ? NET_FASTOPEN_SOCKET : 0);
+
+    return setup_socket(ssock, flags);
+}
+
+int init_server_ctx(server_ctx_t* sctx, const socket_t* ssock, int lfd, socket_set_t* uset, const socket_t* msock)
 {
     assert(sctx);
     assert(ssock);
 
+    memset(&sctx->stats, 0, sizeof(sctx->stats));
     sctx->loop = NULL;
     sctx->ssock = ssock;
-    sctx->usock = usock;
+    sctx->uset = uset;
+    sctx->msock = msock;
+    sctx->acl = NULL;
+    sctx->sources = NULL;
+    sctx->next_source = 0;
+    sctx->port_range = 0;
+    sctx->epoch = 0;
     sctx->stack = NULL;
     sctx->pool = NULL;
     sctx->io.data = sctx;
     sctx->io.fd = -1;
+    sctx->clients.entries = NULL;
+    sctx->rebalance.queue.slots = NULL;
+    sctx->access.records = NULL;
+    sctx->worker = 0;
+    sctx->capture.enabled = 0;
+    sctx->capture.active = 0;
+    memset(&sctx->capture.filter, 0, sizeof(sctx->capture.filter));
+    sctx->admin.msg = NULL;
+    sctx->drained_count = 0;
+    sctx->profile.countdown = gl_settings.cpu_profile;
+    sctx->profile.routes_count = 0;
+    sctx->capture.pipefd[0] = sctx->capture.pipefd[1] = -1;
+    sctx->capture.ring.records = NULL;
+    memset(&sctx->udp, 0, sizeof(sctx->udp));
+    memset(sctx->dst_cache, 0, sizeof(sctx->dst_cache));
+
+    int fd = lfd >= 0 ? dup(lfd) : setup_server_socket(ssock);
+    if (fd < 0) {
+        if (lfd >= 0) ERRP("Failed to dup() listening socket");
+        goto error;
+    }
 
-    int fd = setup_socket(ssock, NET_SERVER_SOCKET);
-    if (fd < 0) goto error;
+    /* libev doesn't expose its epoll fd. It's the first descriptor
+     * ev_loop_new() creates, i.e. the lowest free one right now.
+     * Main thread creates all loops before starting any other thread,
+     * so nobody else can take that descriptor in between */
+    int epfd = gl_settings.busy_poll ? fcntl(fd, F_DUPFD, 0) : -1;
+    if (epfd >= 0) close(epfd);
 
     sctx->loop = ev_loop_new(EVFLAG_NOSIGMASK); // libev doesn't touch sigmask
     if (!sctx->loop) goto error;
 
-    if (grow_pool(sctx, gl_settings.minconn))
+    if (epfd >= 0 && ev_backend(sctx->loop) == EVBACKEND_EPOLL)
+        _epoll_busy_poll(epfd);
+
+    if (gl_settings.udp) {
+        if (udp_init(&sctx->udp, sctx->loop, fd, &sctx->uset, &sctx->acl, &sctx->stats))
+            goto error;
+    } else if (grow_pool(sctx, gl_settings.minconn)) {
+        goto error;
+    }
+
+    if (ip_table_init(&sctx->clients, gl_settings.minconn))
         goto error;
 
+    if (gl_settings.rebalance && handoff_init(&sctx->rebalance.queue, HANDOFF_QUEUE_SIZE))
+        goto error;
+
+    if (gl_settings.access_log && access_ring_init(&sctx->access, ACCESS_RING_SIZE))
+        goto error;
+
+    if (gl_settings.capture) {
+        if (pipe2(sctx->capture.pipefd, O_NONBLOCK | O_CLOEXEC)) {
+            ERRP("Failed to create capture pipe");
+            goto error;
+        }
+
+        // tee() copies as much as fits in capture pipe
+        if (gl_settings.pipe_size)
+            fcntl(sctx->capture.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
+
+        if (capture_ring_init(&sctx->capture.ring, CAPTURE_RING_SIZE))
+            goto error;
+    }
 
     // !!!!!!!!!!!!!!!!!!!!!!!!!
     // no error below this point
@@ -126,11 +646,99 @@ int init_server_ctx(server_ctx_t* sctx, const socket_t* ssock, const socket_t* u
 
     ev_set_userdata(sctx->loop, sctx);
     ev_io_init(&sctx->io, accept_cb, fd, EV_READ);
-    ev_io_start(sctx->loop, &sctx->io);
+    if (!gl_settings.udp) ev_io_start(sctx->loop, &sctx->io);
 
     ev_async_init(&sctx->stop_loop, stop_loop_cb);
     ev_async_start(sctx->loop, &sctx->stop_loop);
 
+    if (gl_settings.acl_file || gl_settings.resolve_interval) {
+        sctx->quiescent.data = sctx;
+        ev_async_init(&sctx->wakeup, wakeup_cb);
+        ev_async_start(sctx->loop, &sctx->wakeup);
+        ev_prepare_init(&sctx->quiescent, quiescent_cb);
+        ev_prepare_start(sctx->loop, &sctx->quiescent);
+    }
+
+    size_t global_rate = _global_rate_share();
+    tb_init(&sctx->rate[DIR_TO_UPSTREAM], global_rate, ev_now(sctx->loop));
+    tb_init(&sctx->rate[DIR_TO_DOWNSTREAM], global_rate, ev_now(sctx->loop));
+
+    sctx->deferred.head = sctx->deferred.tail = -1;
+    sctx->deferred.count = 0;
+    sctx->deferred.check.data = sctx;
+    ev_check_init(&sctx->deferred.check, deferred_check_cb);
+    ev_idle_init(&sctx->deferred.idle, deferred_idle_cb);
+
+    if (gl_settings.quantum) {
+        ev_check_start(sctx->loop, &sctx->deferred.check);
+    }
+
+    sctx->busy.check.data = sctx;
+    sctx->busy.last_work = sctx->busy.last_check = ev_now(sctx->loop);
+    sctx->busy.empty = 0;
+    ev_check_init(&sctx->busy.check, busy_check_cb);
+    ev_idle_init(&sctx->busy.spin, deferred_idle_cb);
+
+    if (gl_settings.busy_spin) {
+        ev_check_start(sctx->loop, &sctx->busy.check);
+        ev_idle_start(sctx->loop, &sctx->busy.spin);
+    }
+
+    memset(&sctx->collect, 0, sizeof(sctx->collect));
+    sctx->collect.check.data = sctx;
+    sctx->collect.tune.data = sctx;
+    ev_check_init(&sctx->collect.check, collect_check_cb);
+    ev_timer_init(&sctx->collect.tune, collect_tune_cb, COLLECT_TUNE_PERIOD, COLLECT_TUNE_PERIOD);
+
+    if (gl_settings.collect_budget) {
+        ev_check_start(sctx->loop, &sctx->collect.check);
+        ev_timer_start(sctx->loop, &sctx->collect.tune);
+    }
+
+    if (gl_settings.rebalance) {
+        struct rebalance* r = &sctx->rebalance;
+        r->async.data = r->prepare.data = r->check.data = sctx;
+        r->poll_start = r->window_start = ev_now(sctx->loop);
+        r->blocked = 0;
+        ev_async_init(&r->async, handoff_cb);
+        ev_async_start(sctx->loop, &r->async);
+        ev_prepare_init(&r->prepare, rebalance_prepare_cb);
+        ev_prepare_start(sctx->loop, &r->prepare);
+        ev_check_init(&r->check, rebalance_check_cb);
+        ev_check_start(sctx->loop, &r->check);
+    }
+
+    memset(&sctx->loop_stats, 0, sizeof(sctx->loop_stats));
+    sctx->loop_stats.prepare.data = sctx->loop_stats.check.data = sctx->loop_stats.lag.data = sctx;
+    ev_prepare_init(&sctx->loop_stats.prepare, loop_prepare_cb);
+    ev_check_init(&sctx->loop_stats.check, loop_check_cb);
+    ev_timer_init(&sctx->loop_stats.lag, loop_lag_cb, LOOP_LAG_INTERVAL, 0.);
+
+    if (gl_settings.loop_stats) {
+        sctx->loop_stats.lag_due = ev_now(sctx->loop) + LOOP_LAG_INTERVAL;
+        ev_prepare_start(sctx->loop, &sctx->loop_stats.prepare);
+        ev_check_start(sctx->loop, &sctx->loop_stats.check);
+        ev_timer_start(sctx->loop, &sctx->loop_stats.lag);
+    }
+
+    if (gl_settings.capture) {
+        sctx->capture.toggle.data = sctx;
+        ev_async_init(&sctx->capture.toggle, capture_cb);
+        ev_async_start(sctx->loop, &sctx->capture.toggle);
+    }
+
+    if (gl_settings.admin) {
+        sctx->admin.async.data = sctx;
+        ev_async_init(&sctx->admin.async, admin_cb);
+        ev_async_start(sctx->loop, &sctx->admin.async);
+    }
+
+    if (_ip_tracking_enabled()) {
+        sctx->expire_clients.data = sctx;
+        ev_timer_init(&sctx->expire_clients, expire_clients_cb, 1., 1.);
+        ev_timer_start(sctx->loop, &sctx->expire_clients);
+    }
+
     return 0;
 
 error:
@@ -145,16 +753,78 @@ void terminate_server_ctx(server_ctx_t* sctx)
     ev_async_send(sctx->loop, &sctx->stop_loop);
 }
 
+void wakeup_server_ctx(server_ctx_t* sctx)
+{
+    assert(sctx);
+    ev_async_send(sctx->loop, &sctx->wakeup);
+}
+
+void capture_server_ctx(server_ctx_t* sctx, int enable)
+{
+    assert(sctx);
+    __atomic_store_n(&sctx->capture.enabled, enable, __ATOMIC_RELEASE);
+    ev_async_send(sctx->loop, &sctx->capture.toggle);
+}
+
+int admin_server_ctx(server_ctx_t* sctx, admin_msg_t* msg)
+{
+    assert(sctx);
+    assert(msg);
+
+    msg->done = 0;
+    __atomic_store_n(&sctx->admin.msg, msg, __ATOMIC_RELEASE);
+    ev_async_send(sctx->loop, &sctx->admin.async);
+
+    for (size_t t = 0; t < 1000; ++t) {
+        if (__atomic_load_n(&msg->done, __ATOMIC_ACQUIRE)) return 0;
+        usleep(1000);
+    }
+
+    // take message back unless worker is running it
+    __atomic_store_n(&sctx->admin.msg, NULL, __ATOMIC_RELEASE);
+    return -1;
+}
+
+void set_server_ctxs(server_ctx_t* sctxs, size_t count)
+{
+    // workers may be running already
+    g_sctxs = sctxs;
+    __atomic_store_n(&g_sctxs_count, count, __ATOMIC_RELEASE);
+}
+
 void free_server_ctx(server_ctx_t* sctx)
 {
     if (!sctx) return;
 
+    if (sctx->rebalance.queue.slots) {
+        // connections handed off but never taken
+        socket_t sock;
+        int fd;
+        while (handoff_pop(&sctx->rebalance.queue, &fd, &sock))
+            close(fd);
+
+        handoff_free(&sctx->rebalance.queue);
+    }
+
+    if (sctx->access.records)
+        access_ring_free(&sctx->access);
+
+    if (sctx->capture.pipefd[0] >= 0) {
+        close(sctx->capture.pipefd[0]);
+        close(sctx->capture.pipefd[1]);
+        sctx->capture.pipefd[0] = sctx->capture.pipefd[1] = -1;
+    }
+
+    if (sctx->capture.ring.records)
+        capture_ring_free(&sctx->capture.ring);
+
     if (sctx->io.fd >= 0) {
         close(sctx->io.fd);
         sctx->io.fd = -1;
     }
 
     if (sctx->loop) {
+        udp_free(&sctx->udp, sctx->loop);
         ev_loop_destroy(sctx->loop);
         sctx->loop = NULL;
     }
@@ -168,6 +838,15 @@ void free_server_ctx(server_ctx_t* sctx)
         stack_free(sctx->stack);
         sctx->stack = NULL;
     }
+
+    if (sctx->clients.entries) {
+        ip_table_free(&sctx->clients);
+    }
+
+    for (size_t i = 0; i < DST_CACHE_SIZE; ++i) {
+        socket_set_unref(sctx->dst_cache[i]);
+        sctx->dst_cache[i] = NULL;
+    }
 }
 
 /******************************************************************
@@ -180,15 +859,76 @@ void connect_cb(struct ev_loop* loop, ev_io* w, int revents)
     server_ctx_t* sctx = (server_ctx_t*) ev_userdata(loop);
     client_ctx_t* cctx = (client_ctx_t*) w->data;
 
+    if (gl_settings.cpu_profile && !(revents & EV_PROFILED_CALL) && _profile_sample(sctx)) {
+        uint64_t start = _cycles();
+        connect_cb(loop, w, revents | EV_PROFILED_CALL);
+        _profile_add(sctx, cctx, _cycles() - start);
+        return;
+    }
+
     errno = 0;
     int err = 0;
     socklen_t len = sizeof(err);
     if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
-        _D("getsockopt() tells that connect() failed: %s", strerror(errno | err));
+        _D("getsockopt() tells that connect() to %s failed: %s",
+           w == &cctx->upstream.race ? cctx->upstream.uset->socks[cctx->upstream.race_addr].to_string
+                                     : cctx->upstream.sock.to_string,
+           strerror(errno | err));
+
+        // try next address right away, other attempt may still succeed
+        _stop_connect(sctx, w);
+        if (_start_connect(sctx, cctx, w) == 0) return;
+        if (cctx->upstream.io.fd >= 0 || cctx->upstream.race.fd >= 0) return;
+
+        ERR("Failed to connect to any address of upstream");
+        cctx->reason = CLOSE_CONNECT_FAILED;
         goto connect_cb_error;
     }
 
-    INFO("connected to %s", sctx->usock->to_string);
+    // first completed attempt wins, cancel the rest
+    ev_timer_stop(loop, &cctx->upstream.stagger);
+    if (w == &cctx->upstream.race) {
+        int fd = w->fd;
+        _stop_connect(sctx, &cctx->upstream.io);
+        ev_io_stop(loop, w);
+        w->fd = -1;
+
+        cctx->upstream.sock = cctx->upstream.uset->socks[cctx->upstream.race_addr];
+        w = &cctx->upstream.io;
+        ev_io_init(w, connect_cb, fd, EV_WRITE);
+    } else {
+        _stop_connect(sctx, &cctx->upstream.race);
+    }
+
+    socket_set_unref(cctx->upstream.uset);
+    cctx->upstream.uset = NULL;
+
+    INFO("connected to %s", cctx->upstream.sock.to_string);
+    cctx->connected = ev_now(loop);
+
+    if (gl_settings.fastopen && cctx->upstream.sock.addr.ss_family != AF_UNIX) {
+        struct tcp_info info;
+        if (!_tcp_info(w->fd, &info) && info.tcpi_state == TCP_SYN_SENT) {
+            /* cookie is known and connect() is deferred, SYN carries
+             * first bytes written to upstream. Don't wait for them too
+             * long as upstream may be the one to speak first */
+            cctx->flags |= CLIENT_FASTOPEN;
+            ev_timer_set(&cctx->upstream.stagger, FASTOPEN_DATA_WAIT, 0.);
+            ev_timer_start(loop, &cctx->upstream.stagger);
+        } else {
+            // no cookie yet, ordinary handshake is done
+            STAT_ADD(&sctx->stats, fastopen_fallbacks, 1);
+        }
+    }
+
+    /* if PROXY header is expected from downstream, original
+     * client address is not known yet, header is sent later */
+    if (gl_settings.send_proxy
+        && !(cctx->flags & CLIENT_AWAIT_PROXY_HEADER)
+        && _send_proxy_header(sctx, cctx)) {
+        cctx->reason = CLOSE_UPSTREAM_ERROR;
+        goto connect_cb_error;
+    }
 
     // we have connected to upstream,
     // so stop connect_cb()
@@ -208,6 +948,27 @@ connect_cb_error:
     _mark_client_ctx_as_free(sctx, cctx);
 }
 
+inline static
+void stagger_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    server_ctx_t* sctx = (server_ctx_t*) ev_userdata(loop);
+    client_ctx_t* cctx = (client_ctx_t*) w->data;
+
+    if (cctx->flags & CLIENT_FASTOPEN) {
+        // client sent nothing, send SYN without data (noop if it's sent already)
+        send(cctx->upstream.io.fd, NULL, 0, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return;
+    }
+
+    // pending attempt is slow, start next one concurrently
+    // (at most two are in flight, io may be free if its attempt failed)
+    if (cctx->upstream.io.fd < 0) {
+        _start_connect(sctx, cctx, &cctx->upstream.io);
+    } else if (cctx->upstream.race.fd < 0) {
+        _start_connect(sctx, cctx, &cctx->upstream.race);
+    }
+}
+
 inline static
 void upstream_cb(struct ev_loop* loop, ev_io* w, int revents)
 {
@@ -215,14 +976,49 @@ void upstream_cb(struct ev_loop* loop, ev_io* w, int revents)
     server_ctx_t* sctx = (server_ctx_t*) ev_userdata(loop);
     client_ctx_t* cctx = (client_ctx_t*) w->data;
 
+    // direct calls are measured as part of the caller
+    if (gl_settings.cpu_profile && !(revents & (EV_DIRECT_CALL | EV_PROFILED_CALL)) && _profile_sample(sctx)) {
+        uint64_t start = _cycles();
+        upstream_cb(loop, w, revents | EV_PROFILED_CALL);
+        _profile_add(sctx, cctx, _cycles() - start);
+        return;
+    }
+
+    if (revents & EV_DEFERRED_CALL) {
+        // reading was paused while waiting in deferred list
+        new_mask |= EV_READ;
+    }
+
+    size_t quota = (revents & EV_READ) ? _rate_quota(sctx, cctx, DIR_TO_DOWNSTREAM) : 0;
+    if ((revents & EV_READ) && !quota) {
+        // rate limit is reached, throttle_cb() resumes reading
+        cctx->flags |= CLIENT_THROTTLED_UPSTREAM;
+        new_mask &= ~EV_READ;
+        revents &= ~EV_READ;
+    }
+
+    quota = _quantum_quota(sctx, cctx, DIR_TO_DOWNSTREAM, revents, quota);
+    if ((revents & EV_READ) && !quota) {
+        // still in debt, deferred_check_cb() gives another quantum next round
+        new_mask &= ~EV_READ;
+        revents &= ~EV_READ;
+    }
+
     if (revents & EV_READ) {
         // upstream -> pipe (-> downstream)
         ssize_t ret = splice(w->fd, NULL,
                              cctx->upstream.pipefd[1], NULL,
-                             MAX_SPLICE_AT_ONCE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                             quota, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
         if (ret > 0) {
             cctx->upstream.size += ret;
+            cctx->bytes[DIR_TO_DOWNSTREAM] += ret;
+            _rate_consume(sctx, cctx, DIR_TO_DOWNSTREAM, ret);
+
+            if (_quantum_consume(sctx, cctx, DIR_TO_DOWNSTREAM, ret)) {
+                // quantum is used up, deferred_check_cb() continues reading
+                new_mask &= ~EV_READ;
+            }
 
             // there is new data in pipe
             // activate downstream write communication which reads data from pipe
@@ -231,6 +1027,9 @@ void upstream_cb(struct ev_loop* loop, ev_io* w, int revents)
             // prevent infinity loop
             if (!(revents & EV_DIRECT_CALL)) {
                 downstream_cb(loop, downstream_io, EV_DIRECT_CALL | EV_WRITE);
+
+                // it could close connection
+                if (cctx->downstream.io.fd < 0) return;
             }
 
             /* idealy cctx->upstream.size should be 0,
@@ -250,15 +1049,19 @@ void upstream_cb(struct ev_loop* loop, ev_io* w, int revents)
 
             if (ret == 0) {
                 // connection closed
+                cctx->reason = CLOSE_UPSTREAM_EOF;
                 goto upstream_cb_error;
             }
 
             if (errno == EAGAIN) {
-                new_mask &= ~EV_READ;
+                // deferred read isn't driven by readiness, socket may be just empty
+                if (!(revents & EV_DEFERRED_CALL))
+                    new_mask &= ~EV_READ;
             } else if (errno == EINTR) {
                 // noop
             } else {
-                ERRP("splice failed when reading from %s", sctx->usock->to_string);
+                ERRP("splice failed when reading from %s", cctx->upstream.sock.to_string);
+                cctx->reason = CLOSE_UPSTREAM_ERROR;
                 goto upstream_cb_error;
             }
         }
@@ -266,29 +1069,44 @@ void upstream_cb(struct ev_loop* loop, ev_io* w, int revents)
 
     if (revents & EV_WRITE) {
         // (downstream ->) pipe -> upstream
-        while (cctx->downstream.size) {
+        size_t budget = gl_settings.quantum ? gl_settings.quantum : MAX_SPLICE_AT_ONCE;
+        while (cctx->downstream.size && budget) {
+            size_t len = cctx->downstream.size < budget ? cctx->downstream.size : budget;
+            if (cctx->flags & CLIENT_CAPTURE)
+                len = _capture(sctx, cctx, DIR_TO_UPSTREAM, len);
+
             ssize_t ret = splice(cctx->downstream.pipefd[0], NULL,
                                  w->fd, NULL,
-                                 cctx->downstream.size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                                 len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
             if (ret > 0) {
                 cctx->downstream.size -= ret;
+                budget -= ret > budget ? budget : ret;
+                _captured(cctx, DIR_TO_UPSTREAM, ret);
 
                 /* there is free space in pipe's buffer
                  * activate downstream read communication which fills it,
                  * but not when downstream called us directly */
-                if (!(revents & EV_DIRECT_CALL)) {
+                if (!(revents & EV_DIRECT_CALL) && !(cctx->flags & (CLIENT_THROTTLED_DOWNSTREAM | CLIENT_DEFERRED_DOWNSTREAM))) {
                     ev_io* downstream_io = &cctx->downstream.io;
                     _reset_events_mask(loop, downstream_io, downstream_io->events | EV_READ);
+
+                    // data kept in userspace/tap won't trigger EV_READ
+                    if (_downstream_input_pending(cctx))
+                        ev_feed_event(loop, downstream_io, EV_READ);
                 }
             } else {
-                if (ret == 0 || errno == EAGAIN) {
+                if (ret == 0) {
                     new_mask &= ~EV_WRITE;
                     break;
+                } else if (errno == EAGAIN) {
+                    // socket's buffer is full, wait for EV_WRITE
+                    break;
                 } else if (errno == EINTR) {
                     continue;
                 } else {
-                    ERRP("splice failed when writting to %s", sctx->usock->to_string);
+                    ERRP("splice failed when writting to %s", cctx->upstream.sock.to_string);
+                    cctx->reason = CLOSE_UPSTREAM_ERROR;
                     goto upstream_cb_error;
                 }
             }
@@ -319,30 +1137,143 @@ void downstream_cb(struct ev_loop* loop, ev_io* w, int revents)
     server_ctx_t* sctx = (server_ctx_t*) ev_userdata(loop);
     client_ctx_t* cctx = (client_ctx_t*) w->data;
 
-    if (revents & EV_READ) {
-        // downstream -> pipe (-> upstream)
-        ssize_t ret = splice(w->fd, NULL,
-                             cctx->downstream.pipefd[1], NULL,
-                             MAX_SPLICE_AT_ONCE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (gl_settings.cpu_profile && !(revents & (EV_DIRECT_CALL | EV_PROFILED_CALL)) && _profile_sample(sctx)) {
+        uint64_t start = _cycles();
+        downstream_cb(loop, w, revents | EV_PROFILED_CALL);
+        _profile_add(sctx, cctx, _cycles() - start);
+        return;
+    }
 
-        if (ret > 0) {
-            cctx->downstream.size += ret;
+    if (cctx->flags & CLIENT_LAZY) {
+        // --lazy-connect: pair with upstream only if client sent something
+        char c;
+        ssize_t ret = recv(w->fd, &c, 1, MSG_PEEK);
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
 
-            /* if there is new data in pipe, try to invoke upstream
-             * callback directly (which safe watcher start/stop loop).
-             * if it failed to write all data to upstream than activat ewatcher */
+        if (ret <= 0) {
+            STAT_ADD(&sctx->stats, lazy_unpaired, 1);
+            cctx->reason = ret == 0 ? CLOSE_DOWNSTREAM_EOF : CLOSE_DOWNSTREAM_ERROR;
+            goto downstream_cb_error;
+        }
 
-            ev_io* upstream_io = &cctx->upstream.io;
+        // connect_cb() starts watcher again
+        cctx->flags &= ~CLIENT_LAZY;
+        ev_io_stop(loop, w);
+        ev_io_set(w, w->fd, EV_READ | EV_WRITE);
+
+        if (_connect_upstream(sctx, cctx, w->fd)) {
+            cctx->reason = CLOSE_CONNECT_FAILED;
+            goto downstream_cb_error;
+        }
+
+        return;
+    }
+
+    if (revents & EV_DEFERRED_CALL) {
+        // reading was paused while waiting in deferred list
+        new_mask |= EV_READ;
+    }
+
+    if ((revents & EV_READ) && (cctx->flags & CLIENT_AWAIT_PROXY_HEADER)) {
+        int ret = _recv_proxy_header(sctx, cctx);
+        if (ret < 0) goto downstream_cb_error;
+
+        if (ret == 0) {
+            // header is incomplete, wait for more data
+            revents &= ~EV_READ;
+        } else if (gl_settings.send_proxy && _send_proxy_header(sctx, cctx)) {
+            cctx->reason = CLOSE_UPSTREAM_ERROR;
+            goto downstream_cb_error;
+        }
+    }
+
+    if (cctx->flags & CLIENT_TLS_HANDSHAKE) {
+        // data from upstream waits in pipe until handshake is done
+        if (revents & EV_DIRECT_CALL) return;
+
+        if (cctx->flags & CLIENT_AWAIT_PROXY_HEADER) {
+            _reset_events_mask(loop, w, EV_READ);
+            return;
+        }
+
+        int events = 0;
+        int ret = tls_handshake(cctx->downstream.tls, &events);
+        if (ret < 0) {
+            cctx->reason = CLOSE_PROTOCOL;
+            goto downstream_cb_error;
+        }
+
+        if (ret == 0) {
+            _reset_events_mask(loop, w, events);
+            return;
+        }
+
+        INFO("TLS handshake with %s is done (kTLS rx: %s, tx: %s)",
+             cctx->downstream.sock.to_string,
+             cctx->downstream.tls->ktls_rx ? "yes" : "no",
+             cctx->downstream.tls->ktls_tx ? "yes" : "no");
+
+        // flush data which upstream might have sent meanwhile
+        cctx->flags &= ~CLIENT_TLS_HANDSHAKE;
+        revents = (revents & ~EV_READ) | EV_WRITE;
+        new_mask = EV_READ | EV_WRITE;
+    }
+
+    size_t quota = (revents & EV_READ) ? _rate_quota(sctx, cctx, DIR_TO_UPSTREAM) : 0;
+    if ((revents & EV_READ) && !quota) {
+        // rate limit is reached, throttle_cb() resumes reading
+        cctx->flags |= CLIENT_THROTTLED_DOWNSTREAM;
+        new_mask &= ~EV_READ;
+        revents &= ~EV_READ;
+    }
+
+    quota = _quantum_quota(sctx, cctx, DIR_TO_UPSTREAM, revents, quota);
+    if ((revents & EV_READ) && !quota) {
+        // still in debt, deferred_check_cb() gives another quantum next round
+        new_mask &= ~EV_READ;
+        revents &= ~EV_READ;
+    }
+
+    if (revents & EV_READ) {
+        // downstream -> pipe (-> upstream)
+        ssize_t ret = _splice_from_downstream(sctx, cctx, quota);
+
+        if (ret > 0) {
+            cctx->bytes[DIR_TO_UPSTREAM] += ret;
+            _rate_consume(sctx, cctx, DIR_TO_UPSTREAM, ret);
+
+            int deferred = _quantum_consume(sctx, cctx, DIR_TO_UPSTREAM, ret);
+            if (deferred) {
+                // quantum is used up, deferred_check_cb() continues reading
+                new_mask &= ~EV_READ;
+            }
+
+            /* if there is new data in pipe, try to invoke upstream
+             * callback directly (which safe watcher start/stop loop).
+             * if it failed to write all data to upstream than activat ewatcher */
+
+            ev_io* upstream_io = &cctx->upstream.io;
 
             // checking for EV_DIRECT_CALL prevents infinity loop
             if (!(revents & EV_DIRECT_CALL)) {
                 upstream_cb(loop, upstream_io, EV_DIRECT_CALL | EV_WRITE);
+
+                // it could close connection
+                if (cctx->downstream.io.fd < 0) return;
             }
 
             // idealy cctx->downstream.size should be 0 now
             if (cctx->downstream.size) {
                 _reset_events_mask(loop, upstream_io, upstream_io->events | EV_WRITE);
             }
+
+            // more data waits for space in pipe
+            if (_downstream_input_pending(cctx) && !(revents & EV_DIRECT_CALL) && !deferred)
+                ev_feed_event(loop, w, EV_READ);
+
+            if (cctx->mirror.size && cctx->mirror.connected) {
+                mirror_cb(loop, &cctx->mirror.io, EV_DIRECT_CALL | EV_WRITE);
+            }
         } else {
             /*
              * ret == 0 - upstream closed connection
@@ -355,15 +1286,19 @@ void downstream_cb(struct ev_loop* loop, ev_io* w, int revents)
 
             if (ret == 0) {
                 // connection close TODO
+                cctx->reason = CLOSE_DOWNSTREAM_EOF;
                 goto downstream_cb_error;
             }
 
             if (errno == EAGAIN) {
-                new_mask &= ~EV_READ;
+                // deferred read isn't driven by readiness, socket may be just empty
+                if (!tls_rx_want_read(cctx->downstream.tls) && !(revents & EV_DEFERRED_CALL))
+                    new_mask &= ~EV_READ;
             } else if (errno == EINTR) {
                 // noop
             } else {
                 ERRP("splice failed when reading from %s", cctx->downstream.sock.to_string);
+                cctx->reason = CLOSE_DOWNSTREAM_ERROR;
                 goto downstream_cb_error;
             }
         }
@@ -371,29 +1306,38 @@ void downstream_cb(struct ev_loop* loop, ev_io* w, int revents)
 
     if (revents & EV_WRITE) {
         // (upstream ->) pipe -> downstream
-        while (cctx->upstream.size) {
-            ssize_t ret = splice(cctx->upstream.pipefd[0], NULL,
-                                 w->fd, NULL,
-                                 cctx->upstream.size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        size_t budget = gl_settings.quantum ? gl_settings.quantum : MAX_SPLICE_AT_ONCE;
+        while (cctx->upstream.size && budget) {
+            size_t len = cctx->upstream.size < budget ? cctx->upstream.size : budget;
+            if (cctx->flags & CLIENT_CAPTURE)
+                len = _capture(sctx, cctx, DIR_TO_DOWNSTREAM, len);
+
+            ssize_t ret = _splice_to_downstream(cctx, len);
 
             if (ret > 0) {
                 cctx->upstream.size -= ret;
+                budget -= ret > budget ? budget : ret;
+                _captured(cctx, DIR_TO_DOWNSTREAM, ret);
 
                 /* there is free space in pipe's buffer
                  * activate upstream read communication which fills it,
                  * but not when upstream called us directly */
-                if (!(revents & EV_DIRECT_CALL)) {
+                if (!(revents & EV_DIRECT_CALL) && !(cctx->flags & (CLIENT_THROTTLED_UPSTREAM | CLIENT_DEFERRED_UPSTREAM))) {
                     ev_io* upstream_io = &cctx->upstream.io;
                     _reset_events_mask(loop, upstream_io, upstream_io->events | EV_READ);
                 }
             } else {
-                if (ret == 0 || errno == EAGAIN) {
+                if (ret == 0) {
                     new_mask &= ~EV_WRITE;
                     break;
+                } else if (errno == EAGAIN) {
+                    // socket's buffer is full, wait for EV_WRITE
+                    break;
                 } else if (errno == EINTR) {
                     continue;
                 } else {
                     ERRP("splice failed when writting to %s", cctx->downstream.sock.to_string);
+                    cctx->reason = CLOSE_DOWNSTREAM_ERROR;
                     goto downstream_cb_error;
                 }
             }
@@ -417,6 +1361,83 @@ downstream_cb_error:
     _mark_client_ctx_as_free(sctx, cctx);
 }
 
+inline static
+void mirror_cb(struct ev_loop* loop, ev_io* w, int revents)
+{
+    /* mirror is strictly best-effort,
+     * any problem with it just stops mirroring */
+    server_ctx_t* sctx = (server_ctx_t*) ev_userdata(loop);
+    client_ctx_t* cctx = (client_ctx_t*) w->data;
+
+    if (revents & EV_READ) {
+        // discard responses without copying them (see tcp(7) MSG_TRUNC)
+        ssize_t ret = recv(w->fd, NULL, MAX_SPLICE_AT_ONCE, MSG_TRUNC | MSG_DONTWAIT);
+        if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+            INFO("mirror %s closed connection", sctx->msock->to_string);
+            goto mirror_cb_error;
+        }
+    }
+
+    if (revents & EV_WRITE) {
+        if (!cctx->mirror.connected) {
+            errno = 0;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+                errno = errno ? errno : err;
+                ERRP("Failed to connect to mirror %s", sctx->msock->to_string);
+                goto mirror_cb_error;
+            }
+
+            cctx->mirror.connected = 1;
+        }
+
+        while (cctx->mirror.size) {
+            ssize_t ret = splice(cctx->mirror.pipefd[0], NULL,
+                                 w->fd, NULL,
+                                 cctx->mirror.size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (ret > 0) {
+                cctx->mirror.size -= ret;
+            } else if (ret < 0 && errno == EINTR) {
+                continue;
+            } else if (ret == 0 || errno == EAGAIN) {
+                break;
+            } else {
+                ERRP("splice failed when writting to mirror %s", sctx->msock->to_string);
+                goto mirror_cb_error;
+            }
+        }
+    }
+
+    _reset_events_mask(loop, w, EV_READ | (cctx->mirror.size ? EV_WRITE : 0));
+    return;
+
+mirror_cb_error:
+    _stop_mirror(sctx, cctx);
+}
+
+inline static
+void throttle_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    client_ctx_t* cctx = (client_ctx_t*) w->data;
+
+    if (cctx->flags & CLIENT_THROTTLED_UPSTREAM) {
+        cctx->flags &= ~CLIENT_THROTTLED_UPSTREAM;
+        ev_io* upstream_io = &cctx->upstream.io;
+        _reset_events_mask(loop, upstream_io, upstream_io->events | EV_READ);
+    }
+
+    if (cctx->flags & CLIENT_THROTTLED_DOWNSTREAM) {
+        cctx->flags &= ~CLIENT_THROTTLED_DOWNSTREAM;
+        ev_io* downstream_io = &cctx->downstream.io;
+        _reset_events_mask(loop, downstream_io, downstream_io->events | EV_READ);
+
+        if (_downstream_input_pending(cctx))
+            ev_feed_event(loop, downstream_io, EV_READ);
+    }
+}
+
 // init_client_ctx() does not close fd if failed
 int init_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx, int fd)
 {
@@ -425,50 +1446,74 @@ int init_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx, int fd)
     cctx->upstream.size = 0;
     cctx->upstream.io.fd = -1;
     cctx->upstream.io.data = cctx;
+    cctx->upstream.race.fd = -1;
+    cctx->upstream.race.data = cctx;
+    cctx->upstream.stagger.data = cctx;
+    ev_init(&cctx->upstream.stagger, stagger_cb);
+    cctx->upstream.uset = NULL;
+    cctx->upstream.next_addr = 0;
     cctx->upstream.pipefd[0] = -1;
     cctx->upstream.pipefd[1] = -1;
 
-    int client_fd = setup_socket(sctx->usock, 0);
-    if (client_fd < 0) goto error;
-
-    int connected = connect_client_socket(sctx->usock, client_fd);
-    if (connected == -1) goto error;
-
-    if (pipe(cctx->upstream.pipefd)) {
-        ERRP("Failed to create pipe");
-        goto error;
-    }
-
+    cctx->downstream.header = NULL;
+    cctx->downstream.header_size = 0;
+    cctx->downstream.tls = NULL;
     cctx->downstream.size = 0;
     cctx->downstream.io.fd = -1;
     cctx->downstream.io.data = cctx;
     cctx->downstream.pipefd[0] = -1;
     cctx->downstream.pipefd[1] = -1;
 
-    if (pipe(cctx->downstream.pipefd)) {
-        ERRP("Failed to create pipe");
+    cctx->mirror.io.fd = -1;
+    cctx->mirror.io.data = cctx;
+    cctx->mirror.pipefd[0] = cctx->mirror.pipefd[1] = -1;
+    cctx->mirror.tapfd[0] = cctx->mirror.tapfd[1] = -1;
+    cctx->mirror.size = cctx->mirror.tap_size = 0;
+    cctx->mirror.connected = 0;
+
+    cctx->flags = gl_settings.accept_proxy ? CLIENT_AWAIT_PROXY_HEADER : 0;
+
+    cctx->throttle.data = cctx;
+    ev_init(&cctx->throttle, throttle_cb);
+    cctx->deficit[DIR_TO_UPSTREAM] = cctx->deficit[DIR_TO_DOWNSTREAM] = 0;
+    cctx->deferred_prev = cctx->deferred_next = -1;
+    tb_init(&cctx->rate[DIR_TO_UPSTREAM], gl_settings.rate_conn, ev_now(sctx->loop));
+    tb_init(&cctx->rate[DIR_TO_DOWNSTREAM], gl_settings.rate_conn, ev_now(sctx->loop));
+
+    cctx->bytes[DIR_TO_UPSTREAM] = cctx->bytes[DIR_TO_DOWNSTREAM] = 0;
+    cctx->start = ev_now(sctx->loop);
+    cctx->connected = 0;
+    cctx->reason = CLOSE_UNKNOWN;
+    cctx->captured[DIR_TO_UPSTREAM] = cctx->captured[DIR_TO_DOWNSTREAM] = 0;
+    cctx->cycles = 0;
+
+    if (gl_settings.lazy_connect) {
+        // downstream_cb() connects upstream once client sends something
+        cctx->flags |= CLIENT_LAZY;
+    } else if (_connect_upstream(sctx, cctx, fd)) {
+        cctx->reason = CLOSE_CONNECT_FAILED;
         goto error;
     }
 
-#ifdef F_SETPIPE_SZ
-    if (gl_settings.pipe_size) {
-        _D("Try to set pipe capacity to %zd", gl_settings.pipe_size);
-        fcntl(cctx->upstream.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
-        fcntl(cctx->downstream.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
-    }
-#endif
-
     // !!!!!!!!!!!!!!!!!!!!!!!!!
     // no error below this point
     // !!!!!!!!!!!!!!!!!!!!!!!!!
 
-    ev_io_init(&cctx->upstream.io, connect_cb, client_fd, EV_WRITE);
     ev_io_init(&cctx->downstream.io, downstream_cb, fd, EV_READ | EV_WRITE);
-    ev_io_start(sctx->loop, &cctx->upstream.io);
+
+    if (cctx->flags & CLIENT_LAZY) {
+        ev_io_set(&cctx->downstream.io, fd, EV_READ);
+        ev_io_start(sctx->loop, &cctx->downstream.io);
+    }
+
+    if (!(cctx->flags & CLIENT_AWAIT_PROXY_HEADER)) {
+        _track_client(sctx, cctx);
+        _capture_client(sctx, cctx);
+    }
+
     return 0;
 
 error:
-    if (client_fd >= 0) close(client_fd);
     deinit_client_ctx(sctx, cctx);
     return -1;
 }
@@ -478,13 +1523,38 @@ void deinit_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx)
     assert(sctx);
     if (!cctx) return;
 
+    if (sctx->access.records)
+        _log_access(sctx, cctx);
+
+    if (gl_settings.cpu_profile) {
+        profile_route_t* route = _profile_route(sctx->profile.routes, &sctx->profile.routes_count,
+                                                cctx->connected ? &cctx->upstream.sock : NULL);
+        route->cycles += cctx->cycles;
+        route->conns++;
+    }
+
+    if (cctx->flags & CLIENT_CAPTURE) {
+        _capture_event(sctx, cctx, CAPTURE_CLOSE);
+        cctx->flags &= ~CLIENT_CAPTURE;
+    }
+
+    ev_timer_stop(sctx->loop, &cctx->upstream.stagger);
+    _stop_connect(sctx, &cctx->upstream.race);
+    socket_set_unref(cctx->upstream.uset);
+    cctx->upstream.uset = NULL;
+
     if (cctx->upstream.io.fd >= 0) {
-        INFO("disconnect upstream %s", sctx->usock->to_string);
+        INFO("disconnect upstream %s", cctx->upstream.sock.to_string);
         ev_io_stop(sctx->loop, &cctx->upstream.io);
-        close(cctx->upstream.io.fd);
+        _close_upstream(sctx, cctx);
         cctx->upstream.io.fd = -1;
     }
 
+    if (cctx->downstream.tls) {
+        tls_conn_free(cctx->downstream.tls);
+        cctx->downstream.tls = NULL;
+    }
+
     if (cctx->downstream.io.fd >= 0) {
         INFO("disconnect downstream %s", cctx->downstream.sock.to_string);
         ev_io_stop(sctx->loop, &cctx->downstream.io);
@@ -492,6 +1562,22 @@ void deinit_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx)
         cctx->downstream.io.fd = -1;
     }
 
+    if (cctx->downstream.header) {
+        free(cctx->downstream.header);
+        cctx->downstream.header = NULL;
+    }
+
+    ev_timer_stop(sctx->loop, &cctx->throttle);
+    _undefer(sctx, cctx);
+    _untrack_client(sctx, cctx);
+    _stop_mirror(sctx, cctx);
+
+    if (cctx->mirror.tapfd[0] >= 0) {
+        close(cctx->mirror.tapfd[0]);
+        close(cctx->mirror.tapfd[1]);
+        cctx->mirror.tapfd[0] = cctx->mirror.tapfd[1] = -1;
+    }
+
     if (cctx->upstream.pipefd[0] >= 0) {
         close(cctx->upstream.pipefd[0]);
         cctx->upstream.pipefd[0] = -1;
@@ -519,112 +1605,1409 @@ void deinit_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx)
  ******************************************************************/
 
 inline static
-void _reset_events_mask(struct ev_loop* loop, ev_io* io, int events)
+void _log_access(server_ctx_t* sctx, client_ctx_t* cctx)
 {
-    assert(io);
-    //_D("set new events mask %d for %d", events, io->fd);
+    // logger thread fills in worker
+    access_record_t* rec = access_ring_reserve(&sctx->access);
+    if (!rec) {
+        STAT_ADD(&sctx->stats, access_log_drops, 1);
+        return;
+    }
 
-    if (events == 0) {
-        ev_io_stop(loop, io);
-    } else if (!ev_is_active(io)) {
-        ev_io_set(io, io->fd, events);
-        ev_io_start(loop, io);
-    } else if (io->events != events) {
-        ev_io_stop(loop, io);
-        ev_io_set(io, io->fd, events);
-        ev_io_start(loop, io);
+    ev_tstamp now = ev_now(sctx->loop);
+    rec->start_us = cctx->start * 1e6;
+    rec->bytes_up = cctx->bytes[DIR_TO_UPSTREAM];
+    rec->bytes_down = cctx->bytes[DIR_TO_DOWNSTREAM];
+    rec->connect_us = 0;
+    if (cctx->connected) // non-zero even if it happened in the same loop iteration
+        rec->connect_us = (uint32_t) ((cctx->connected - cctx->start) * 1e6) ?: 1;
+    rec->duration_ms = (now - cctx->start) * 1e3;
+    rec->reason = cctx->reason;
+    rec->version = ACCESS_RECORD_VERSION;
+    access_record_addr(rec->client_addr, &rec->client_port, &cctx->downstream.sock);
+
+    if (cctx->connected) {
+        access_record_addr(rec->upstream_addr, &rec->upstream_port, &cctx->upstream.sock);
+    } else {
+        memset(rec->upstream_addr, 0, sizeof(rec->upstream_addr));
+        rec->upstream_port = 0;
     }
+
+    access_ring_commit(&sctx->access);
 }
 
 inline static
-int grow_pool(server_ctx_t* sctx, size_t size)
+void _capture_start(server_ctx_t* sctx)
 {
-    assert(sctx);
+    // capture writer thread opens file once records show up
+    sctx->capture.active = 1;
+    INFO("capturing connections to %s.%zu", gl_settings.capture, sctx->worker);
+
+    // pick connections which are already established, pool entries not in use have no downstream
+    for (size_t i = 0; i < sctx->stack->size; ++i) {
+        client_ctx_t* cctx = &sctx->pool[i];
+        if (cctx->downstream.io.fd >= 0 && !(cctx->flags & CLIENT_AWAIT_PROXY_HEADER))
+            _capture_client(sctx, cctx);
+    }
+}
 
-    /* grow pool has O(n) complexety.
-     * But good news is that pushing to
-     * stack is very-very cache friendly */
-    _D("grow_pool to size %zd", size);
+inline static
+void _capture_stop(server_ctx_t* sctx)
+{
+    for (size_t i = 0; i < sctx->stack->size; ++i) {
+        client_ctx_t* cctx = &sctx->pool[i];
+        if (cctx->downstream.io.fd < 0) continue;
 
-    size_t old_size = 0;
-    int_stack_t* stack = NULL;
-    client_ctx_t* pool = NULL;
+        cctx->flags &= ~CLIENT_CAPTURE;
+        cctx->captured[DIR_TO_UPSTREAM] = cctx->captured[DIR_TO_DOWNSTREAM] = 0;
+    }
 
-    pool = realloc(sctx->pool, size);
-    if (!pool) {
-        ERR("Failed to allocate pool");
-        goto error;
+    sctx->capture.active = 0;
+    INFO("capture is stopped");
+}
+
+inline static
+void _capture_client(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    if (!sctx->capture.active || !capture_filter_match(&sctx->capture.filter, &cctx->downstream.sock))
+        return;
+
+    cctx->flags |= CLIENT_CAPTURE;
+    cctx->captured[DIR_TO_UPSTREAM] = cctx->captured[DIR_TO_DOWNSTREAM] = 0;
+    _capture_event(sctx, cctx, CAPTURE_OPEN);
+}
+
+inline static
+capture_record_t* _capture_record(server_ctx_t* sctx, client_ctx_t* cctx, int event)
+{
+    // slot is taken before data goes to capture pipe, so data never waits there without header
+    capture_record_t* rec = capture_ring_reserve(&sctx->capture.ring);
+    if (!rec) {
+        STAT_ADD(&sctx->stats, capture_drops, 1);
+        return NULL;
     }
 
-    if (sctx->stack) {
-        old_size = sctx->stack->size;
-        stack = stack_grow(sctx->stack, size);
-    } else {
-        stack = stack_init(size);
+    rec->ts_us = ev_now(sctx->loop) * 1e6;
+    rec->len = 0;
+    rec->event = event;
+    rec->version = CAPTURE_RECORD_VERSION;
+    access_record_addr(rec->client_addr, &rec->client_port, &cctx->downstream.sock);
+    return rec;
+}
+
+inline static
+void _capture_event(server_ctx_t* sctx, client_ctx_t* cctx, int event)
+{
+    if (_capture_record(sctx, cctx, event))
+        capture_ring_commit(&sctx->capture.ring);
+}
+
+inline static
+size_t _capture(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t len)
+{
+    /* relay pipe is tee()'d right before it's written out, return how
+     * much to write. tee() copies from head of pipe, so bytes which
+     * partial write left there are captured already and written first.
+     * Capture is best effort, data goes on even if it isn't captured */
+    if (cctx->captured[dir])
+        return len < cctx->captured[dir] ? len : cctx->captured[dir];
+
+    capture_record_t* rec = _capture_record(sctx, cctx, dir);
+    if (!rec) return len;
+
+    // capture writer thread drains pipe, full one means it fell behind
+    int pipefd = dir == DIR_TO_UPSTREAM ? cctx->downstream.pipefd[0] : cctx->upstream.pipefd[0];
+    ssize_t ret = tee(pipefd, sctx->capture.pipefd[1], len, SPLICE_F_NONBLOCK);
+    if (ret <= 0) {
+        STAT_ADD(&sctx->stats, capture_drops, 1);
+        return len;
     }
 
-    if (!stack) {
-        ERR("Failed to grow stack");
-        goto error;
+    rec->len = ret;
+    capture_ring_commit(&sctx->capture.ring);
+    STAT_ADD(&sctx->stats, captured_bytes, ret);
+
+    cctx->captured[dir] = ret;
+    return ret;
+}
+
+inline static
+void _captured(client_ctx_t* cctx, int dir, size_t len)
+{
+    // TLS reports bytes it read from pipe earlier, don't go below 0
+    cctx->captured[dir] -= len < cctx->captured[dir] ? len : cctx->captured[dir];
+}
+
+inline static
+void _admin_conns(server_ctx_t* sctx, FILE* out)
+{
+    if (gl_settings.udp) {
+        fprintf(out, "error: UDP flows aren't listed\n");
+        return;
     }
 
-    _D("fill stack with items from %zd to %zd", size - 1, old_size);
-    for (int i = size - 1; i >= (int) old_size; --i) {
-        stack_push(stack, i);
+    // pool entries not in use have no downstream
+    ev_tstamp now = ev_now(sctx->loop);
+    for (size_t i = 0; i < sctx->stack->size; ++i) {
+        client_ctx_t* cctx = &sctx->pool[i];
+        if (cctx->downstream.io.fd < 0) continue;
+
+        fprintf(out, "worker=%zu idx=%zu client=%s upstream=%s age=%.3f up=%llu down=%llu flags=0x%x\n",
+                sctx->worker, i, cctx->downstream.sock.to_string,
+                cctx->connected ? cctx->upstream.sock.to_string : "-",
+                now - cctx->start,
+                (unsigned long long) cctx->bytes[DIR_TO_UPSTREAM],
+                (unsigned long long) cctx->bytes[DIR_TO_DOWNSTREAM],
+                cctx->flags);
     }
+}
 
-    sctx->pool = pool;
-    sctx->stack = stack;
-    return 0;
+inline static
+void _admin_kill(server_ctx_t* sctx, size_t idx, FILE* out)
+{
+    if (gl_settings.udp || idx >= sctx->stack->size || sctx->pool[idx].downstream.io.fd < 0) {
+        fprintf(out, "error: worker %zu has no connection %zu\n", sctx->worker, idx);
+        return;
+    }
 
-error:
-    free(pool);
-    free(stack);
-    return -1;
+    client_ctx_t* cctx = &sctx->pool[idx];
+    INFO("closing connection from %s by admin command", cctx->downstream.sock.to_string);
+    fprintf(out, "closed %s\n", cctx->downstream.sock.to_string);
+
+    cctx->reason = CLOSE_ADMIN;
+    deinit_client_ctx(sctx, cctx);
+    _mark_client_ctx_as_free(sctx, cctx);
 }
 
 inline static
-client_ctx_t* _get_client_ctx(server_ctx_t* sctx)
+void _admin_drain(server_ctx_t* sctx, const socket_set_t* set, int drain, FILE* out)
 {
-    /* _get_client_ctx() has ammortized O(1) complexity
-     * i.e. we need to scan N items no often then N calls of _get_client_ctx() */
+    for (size_t i = 0; i < set->count; ++i) {
+        const socket_t* sock = &set->socks[i];
+        int idx = _drained(sctx, sock);
+
+        if (drain && idx < 0) {
+            if (sctx->drained_count == MAX_DRAINED) {
+                fprintf(out, "error: too many drained addresses, %s isn't drained\n", sock->to_string);
+                continue;
+            }
 
-    assert(sctx);
-    assert(sctx->stack);
+            sctx->drained[sctx->drained_count++] = *sock;
+        } else if (!drain && idx >= 0) {
+            sctx->drained[idx] = sctx->drained[--sctx->drained_count];
+        }
+    }
 
-    int idx = stack_peek(sctx->stack);
-    if (idx < 0 && sctx->stack->size < gl_settings.maxconn) {
-        grow_pool(sctx, sctx->stack->size * 2 + 1); // + 1 to hanle size == 0
-        idx = stack_peek(sctx->stack);
+    fprintf(out, "worker=%zu drained=%zu\n", sctx->worker, sctx->drained_count);
+}
+
+inline static
+int _drained(server_ctx_t* sctx, const socket_t* sock)
+{
+    // return index in sctx->drained or -1
+    for (size_t i = 0; i < sctx->drained_count; ++i) {
+        if (sctx->drained[i].addrlen == sock->addrlen
+            && memcmp(&sctx->drained[i].addr, &sock->addr, sock->addrlen) == 0)
+            return i;
     }
 
-    assert(idx < sctx->stack->size);
-    return idx >= 0 ? &sctx->pool[idx] : NULL;
+    return -1;
 }
 
 inline static
-void _mark_client_ctx_as_used(server_ctx_t* sctx, client_ctx_t* cctx)
+uint64_t _cycles()
 {
-    assert(sctx);
-    assert(cctx);
-    assert(sctx->stack);
-    assert(!stack_empty(sctx->stack));
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // nanoseconds instead of cycles
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-    cctx->idx = stack_pop(sctx->stack);
-    assert(cctx->idx >= 0);
-    assert(cctx->idx < sctx->stack->size);
+inline static
+int _profile_sample(server_ctx_t* sctx)
+{
+    // every --cpu-profile'th callback is measured
+    if (--sctx->profile.countdown) return 0;
+    sctx->profile.countdown = gl_settings.cpu_profile;
+    return 1;
 }
 
 inline static
-void _mark_client_ctx_as_free(server_ctx_t* sctx, client_ctx_t* cctx)
+void _profile_add(server_ctx_t* sctx, client_ctx_t* cctx, uint64_t cycles)
 {
-    assert(sctx);
-    assert(cctx);
-    assert(sctx->stack);
-    assert(cctx->idx >= 0);
-    assert(!stack_full(sctx->stack));
+    // sample stands for cpu_profile callbacks
+    cycles *= gl_settings.cpu_profile;
+    STAT_ADD(&sctx->stats, profile_samples, 1);
 
-    stack_push(sctx->stack, cctx->idx);
-    // TODO shrink pool
+    if (cctx->downstream.io.fd >= 0) {
+        cctx->cycles += cycles;
+        return;
+    }
+
+    // callback closed connection, deinit_client_ctx() has already counted the rest
+    profile_route_t* route = _profile_route(sctx->profile.routes, &sctx->profile.routes_count,
+                                            cctx->connected ? &cctx->upstream.sock : NULL);
+    route->cycles += cycles;
+}
+
+inline static
+profile_route_t* _profile_route(profile_route_t* routes, size_t* count, const socket_t* sock)
+{
+    /* find or add entry of upstream address (NULL if connection never
+     * reached upstream). Once the table is full, the last entry takes
+     * all remaining addresses */
+    socklen_t addrlen = sock ? sock->addrlen : 0;
+    for (size_t i = 0; i < *count; ++i) {
+        if (routes[i].sock.addrlen == addrlen
+            && (!addrlen || memcmp(&routes[i].sock.addr, &sock->addr, addrlen) == 0))
+            return &routes[i];
+    }
+
+    if (*count == PROFILE_MAX_ROUTES)
+        return &routes[PROFILE_MAX_ROUTES - 1];
+
+    profile_route_t* route = &routes[(*count)++];
+    memset(route, 0, sizeof(profile_route_t));
+    if (sock) route->sock = *sock;
+    return route;
 }
 
+inline static
+void _admin_profile(server_ctx_t* sctx, size_t top, FILE* out)
+{
+    if (!gl_settings.cpu_profile) {
+        fprintf(out, "error: profile requires --cpu-profile\n");
+        return;
+    }
+
+    if (gl_settings.udp) {
+        fprintf(out, "error: UDP flows aren't profiled\n");
+        return;
+    }
+
+    // routes include connections which are still open
+    profile_route_t routes[PROFILE_MAX_ROUTES];
+    size_t routes_count = sctx->profile.routes_count;
+    memcpy(routes, sctx->profile.routes, routes_count * sizeof(profile_route_t));
+
+    for (size_t i = 0; i < sctx->stack->size; ++i) {
+        client_ctx_t* cctx = &sctx->pool[i];
+        if (cctx->downstream.io.fd < 0) continue;
+
+        profile_route_t* route = _profile_route(routes, &routes_count, cctx->connected ? &cctx->upstream.sock : NULL);
+        route->cycles += cctx->cycles;
+        route->conns++;
+    }
+
+    // top heaviest connections by selection, top is small
+    uint64_t prev = UINT64_MAX;
+    size_t prev_idx = 0;
+    for (size_t n = 0; n < top; ++n) {
+        client_ctx_t* best = NULL;
+        for (size_t i = 0; i < sctx->stack->size; ++i) {
+            client_ctx_t* cctx = &sctx->pool[i];
+            if (cctx->downstream.io.fd < 0) continue;
+
+            // order by (cycles desc, idx asc), skipping already printed ones
+            if (cctx->cycles > prev || (cctx->cycles == prev && i <= prev_idx)) continue;
+            if (!best || cctx->cycles > best->cycles) best = cctx;
+        }
+
+        if (!best) break;
+
+        prev = best->cycles;
+        prev_idx = best - sctx->pool;
+        fprintf(out, "worker=%zu conn idx=%zu client=%s upstream=%s age=%.3f cycles=%llu\n",
+                sctx->worker, prev_idx, best->downstream.sock.to_string,
+                best->connected ? best->upstream.sock.to_string : "-",
+                ev_now(sctx->loop) - best->start, (unsigned long long) best->cycles);
+    }
+
+    for (size_t i = 0; i < routes_count; ++i) {
+        fprintf(out, "worker=%zu route upstream=%s conns=%zu cycles=%llu\n",
+                sctx->worker, routes[i].sock.addrlen ? routes[i].sock.to_string : "-",
+                routes[i].conns, (unsigned long long) routes[i].cycles);
+    }
+}
+
+inline static
+void _reset_events_mask(struct ev_loop* loop, ev_io* io, int events)
+{
+    assert(io);
+    //_D("set new events mask %d for %d", events, io->fd);
+
+    if (events == 0) {
+        ev_io_stop(loop, io);
+    } else if (!ev_is_active(io)) {
+        ev_io_set(io, io->fd, events);
+        ev_io_start(loop, io);
+    } else if (io->events != events) {
+        ev_io_stop(loop, io);
+        ev_io_set(io, io->fd, events);
+        ev_io_start(loop, io);
+    }
+}
+
+inline static
+socket_set_t* _original_dst(server_ctx_t* sctx, int fd)
+{
+    /* return (referenced) address set with original destination of
+     * intercepted connection, NULL if it shouldn't be proxied */
+    socket_t dst;
+    if (original_dst(fd, &dst, gl_settings.transparent == TRANSPARENT_REDIRECT))
+        return NULL;
+
+    /* connection made to proxy itself (not intercepted) would loop forever.
+     * With wildcard listener port alone doesn't tell, intercepted traffic
+     * to the same port on other hosts is fine, so look at the address */
+    socket_t self = *sctx->ssock;
+    unmap_socket_v4(&self);
+    struct sockaddr_in6* self6 = (struct sockaddr_in6*) &self.addr;
+    int wildcard = self.addr.ss_family == AF_INET6
+                 ? IN6_IS_ADDR_UNSPECIFIED(&self6->sin6_addr)
+                 : ((struct sockaddr_in*) &self.addr)->sin_addr.s_addr == htonl(INADDR_ANY);
+
+    if (ip_key_port(&dst) == ip_key_port(&self)
+        && (wildcard ? local_address(&dst) : dst.addrlen == self.addrlen && memcmp(&dst.addr, &self.addr, dst.addrlen) == 0)) {
+        ERR("Connection to %s isn't intercepted, refusing to connect to itself", dst.to_string);
+        return NULL;
+    }
+
+    ip_key_t key = ip_key_from_socket(&dst);
+    key.lo ^= ip_key_port(&dst);
+    socket_set_t** slot = &sctx->dst_cache[ip_key_hash(key) & (DST_CACHE_SIZE - 1)];
+    socket_set_t* set = *slot;
+
+    if (!set || set->socks[0].addrlen != dst.addrlen || memcmp(&set->socks[0].addr, &dst.addr, dst.addrlen)) {
+        set = malloc(sizeof(socket_set_t) + sizeof(socket_t));
+        if (!set) {
+            ERRP("Failed to allocate socket_set_t");
+            return NULL;
+        }
+
+        set->count = 1;
+        set->refs = 1;
+        set->socks[0] = dst;
+
+        // connections still connecting to evicted destination keep their references
+        socket_set_unref(*slot);
+        *slot = set;
+    }
+
+    return socket_set_ref(set);
+}
+
+inline static
+int _next_source(server_ctx_t* sctx, const socket_t* dst, socket_t* src)
+{
+    // round robin over --source addresses of destination's family
+    const socket_set_t* sources = sctx->sources;
+    if (!sources) return 0;
+
+    for (size_t i = 0; i < sources->count; ++i) {
+        const socket_t* sock = &sources->socks[sctx->next_source++ % sources->count];
+        if (sock->addr.ss_family == dst->addr.ss_family) {
+            *src = *sock;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+inline static
+int _bind_upstream(server_ctx_t* sctx, client_ctx_t* cctx, int fd, const socket_t* sock)
+{
+    if (sock->addr.ss_family == AF_UNIX) return 0;
+
+    // workers pick ephemeral ports from disjoint ranges, so they don't collide in kernel
+    if (sctx->port_range && setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &sctx->port_range, sizeof(sctx->port_range))) {
+        ERRP("setsockopt(IP_LOCAL_PORT_RANGE) failed, Linux 6.3+ is required, using whole range");
+        sctx->port_range = 0;
+    }
+
+    socket_t src;
+    if (gl_settings.spoof_source) {
+        // with --spoof-source upstream sees client's address instead of proxy's one
+        src = cctx->downstream.sock;
+        unmap_socket_v4(&src);
+
+        if (src.addr.ss_family != sock->addr.ss_family) {
+            ERR("Can't connect from %s to %s, address families differ", src.to_string, sock->to_string);
+            return -1;
+        }
+    } else if (!_next_source(sctx, sock, &src)) {
+        return 0;
+    }
+
+    // any free port
+    if (src.addr.ss_family == AF_INET6) {
+        ((struct sockaddr_in6*) &src.addr)->sin6_port = 0;
+    } else {
+        ((struct sockaddr_in*) &src.addr)->sin_port = 0;
+    }
+
+    /* bind() to port 0 would reserve port unique for source address
+     * alone, i.e. at most ~28k connections per address. Let connect()
+     * choose it instead, then only whole 4-tuple has to be unique */
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)))
+        ERRP("setsockopt(IP_BIND_ADDRESS_NO_PORT) failed");
+
+    if (bind(fd, (struct sockaddr*) &src.addr, src.addrlen)) {
+        if (errno == EADDRINUSE || errno == EADDRNOTAVAIL)
+            STAT_ADD(&sctx->stats, upstream_addr_unavail, 1);
+
+        ERRP("Failed to bind upstream socket to %s", src.to_string);
+        return -1;
+    }
+
+    return 0;
+}
+
+inline static
+void _close_upstream(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    int fd = cctx->upstream.io.fd;
+    struct tcp_info info;
+    if ((cctx->flags & CLIENT_FASTOPEN) && !_tcp_info(fd, &info) && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+        STAT_ADD(&sctx->stats, fastopen_connects, 1);
+
+    /* --upstream-rst: abort connection instead of closing it gracefully,
+     * so proxy doesn't keep it in TIME_WAIT and its port is free right
+     * away. Only if everything sent was acked, RST drops unsent data */
+    int unsent = -1;
+    if (gl_settings.upstream_rst && ioctl(fd, SIOCOUTQ, &unsent) == 0 && unsent == 0) {
+        _set_rst_on_close(fd);
+        STAT_ADD(&sctx->stats, upstream_rst_closes, 1);
+    }
+
+    close(fd);
+}
+
+inline static
+int _connect_upstream(server_ctx_t* sctx, client_ctx_t* cctx, int fd)
+{
+    /* allocate pipes and start connecting to upstream, connect_cb()
+     * starts downstream_cb() once connected. Caller cleans up on error */
+    if (pipe2(cctx->upstream.pipefd, O_NONBLOCK)) {
+        ERRP("Failed to create pipe");
+        return -1;
+    }
+
+    if (pipe2(cctx->downstream.pipefd, O_NONBLOCK)) {
+        ERRP("Failed to create pipe");
+        return -1;
+    }
+
+    _init_mirror(sctx, cctx);
+
+    if (gl_settings.tls_cert) {
+        cctx->downstream.tls = tls_conn_new(fd);
+        if (!cctx->downstream.tls) return -1;
+        cctx->flags |= CLIENT_TLS_HANDSHAKE;
+    }
+
+#ifdef F_SETPIPE_SZ
+    if (gl_settings.pipe_size) {
+        _D("Try to set pipe capacity to %zd", gl_settings.pipe_size);
+        fcntl(cctx->upstream.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
+        fcntl(cctx->downstream.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
+    }
+#endif
+
+    if (gl_settings.transparent) {
+        cctx->upstream.uset = _original_dst(sctx, fd);
+        if (!cctx->upstream.uset) return -1;
+    } else {
+        /* resolver thread may replace address set any time, keep
+         * the current one until connected. It's not freed before this
+         * loop iteration ends, so taking a reference here is safe */
+        cctx->upstream.uset = socket_set_ref(__atomic_load_n(&sctx->uset, __ATOMIC_ACQUIRE));
+    }
+
+    if (_start_connect(sctx, cctx, &cctx->upstream.io)) {
+        ERR("Failed to connect to any address of upstream");
+        return -1;
+    }
+
+    return 0;
+}
+
+inline static
+int _start_connect(server_ctx_t* sctx, client_ctx_t* cctx, ev_io* w)
+{
+    /* Happy Eyeballs (RFC 8305): start connecting w to next address,
+     * if it's not done in CONNECTION_ATTEMPT_DELAY next one is started
+     * concurrently. Addresses failing right away are skipped.
+     * Return -1 if there are no addresses left */
+    const socket_set_t* uset = cctx->upstream.uset;
+
+    while (cctx->upstream.next_addr < uset->count) {
+        size_t idx = cctx->upstream.next_addr++;
+        const socket_t* sock = &uset->socks[idx];
+        if (sctx->drained_count && _drained(sctx, sock) >= 0) continue;
+
+        int flags = (gl_settings.spoof_source ? NET_TRANSPARENT_SOCKET : 0)
+                  | (gl_settings.fastopen ? NET_FASTOPEN_SOCKET : 0);
+
+        int fd = setup_socket(sock, flags);
+        if (fd < 0) continue;
+
+        STAT_ADD(&sctx->stats, upstream_connects, 1);
+
+        if (_bind_upstream(sctx, cctx, fd, sock)) {
+            close(fd);
+            continue;
+        }
+
+        if (connect_client_socket(sock, fd) == -1) {
+            // no free port for this destination
+            if (errno == EADDRNOTAVAIL)
+                STAT_ADD(&sctx->stats, upstream_addr_unavail, 1);
+
+            close(fd);
+            continue;
+        }
+
+        if (w == &cctx->upstream.race) {
+            cctx->upstream.race_addr = idx;
+        } else {
+            cctx->upstream.sock = *sock;
+        }
+
+        ev_io_init(w, connect_cb, fd, EV_WRITE);
+        ev_io_start(sctx->loop, w);
+
+        ev_timer_stop(sctx->loop, &cctx->upstream.stagger);
+        if (cctx->upstream.next_addr < uset->count) {
+            ev_timer_set(&cctx->upstream.stagger, CONNECTION_ATTEMPT_DELAY, 0.);
+            ev_timer_start(sctx->loop, &cctx->upstream.stagger);
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+inline static
+void _stop_connect(server_ctx_t* sctx, ev_io* w)
+{
+    if (w->fd < 0) return;
+
+    ev_io_stop(sctx->loop, w);
+    close(w->fd);
+    w->fd = -1;
+}
+
+inline static
+int _send_proxy_header(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    /* header is sent by a single send() right after connect,
+     * socket's buffer is empty, so partial write is not expected.
+     * Payload continues to go through splice() afterwards */
+
+    socket_t local;
+    local.addrlen = sizeof(local.addr);
+    if (getsockname(cctx->downstream.io.fd, (struct sockaddr*) &local.addr, &local.addrlen)) {
+        ERRP("Failed to getsockname() of %s", cctx->downstream.sock.to_string);
+        return -1;
+    }
+
+    // on dual stack listener IPv4 clients come as ::ffff:a.b.c.d,
+    // upstream should see them as TCP4. Mixed families go as UNKNOWN/LOCAL
+    socket_t src = cctx->downstream.sock;
+    unmap_socket_v4(&src);
+    unmap_socket_v4(&local);
+
+    char buf[PROXY_PROTOCOL_MAX_HEADER_SIZE];
+    ssize_t size = build_proxy_header(buf, sizeof(buf), gl_settings.send_proxy, &src, &local);
+    if (size < 0) return -1;
+
+    ssize_t ret = send(cctx->upstream.io.fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret != size) {
+        ERRP("Failed to send PROXY header to %s", cctx->upstream.sock.to_string);
+        return -1;
+    }
+
+    return 0;
+}
+
+inline static
+int _recv_proxy_header(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    /* return 1 if PROXY header was consumed, 0 if more data is needed.
+     * Header is peeked first, so only header bytes are read from socket
+     * and the payload is left for splice(). Usually the whole header comes
+     * in a single segment and no allocation happens. Otherwise bytes of
+     * incomplete header are moved into cctx->downstream.header to keep
+     * the watcher from spinning on a readable socket */
+
+    char buf[PROXY_PROTOCOL_MAX_INPUT_SIZE];
+    char* header = cctx->downstream.header ? cctx->downstream.header : buf;
+    size_t have = cctx->downstream.header_size;
+    int fd = cctx->downstream.io.fd;
+
+    ssize_t ret = recv(fd, header + have, PROXY_PROTOCOL_MAX_INPUT_SIZE - have, MSG_PEEK);
+    if (ret <= 0) {
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if (ret < 0) ERRP("Failed to read PROXY header from %s", cctx->downstream.sock.to_string);
+        cctx->reason = ret == 0 ? CLOSE_DOWNSTREAM_EOF : CLOSE_DOWNSTREAM_ERROR;
+        return -1;
+    }
+
+    socket_t sock = cctx->downstream.sock;
+    ssize_t len = parse_proxy_header(header, have + ret, &sock);
+    if (len < 0) {
+        ERR("Invalid PROXY header from %s", cctx->downstream.sock.to_string);
+        cctx->reason = CLOSE_PROTOCOL;
+        return -1;
+    }
+
+    // all peeked bytes belong to incomplete header
+    size_t consume = len > 0 ? len - have : (size_t) ret;
+    if (recv(fd, header + have, consume, 0) != (ssize_t) consume) {
+        ERRP("Failed to consume PROXY header from %s", cctx->downstream.sock.to_string);
+        cctx->reason = CLOSE_DOWNSTREAM_ERROR;
+        return -1;
+    }
+
+    if (len == 0) {
+        if (!cctx->downstream.header) {
+            cctx->downstream.header = malloc_or_die(PROXY_PROTOCOL_MAX_INPUT_SIZE);
+            memcpy(cctx->downstream.header, buf, consume);
+        }
+
+        cctx->downstream.header_size += consume;
+        return 0;
+    }
+
+    if (cctx->downstream.header) {
+        free(cctx->downstream.header);
+        cctx->downstream.header = NULL;
+        cctx->downstream.header_size = 0;
+    }
+
+    cctx->flags &= ~CLIENT_AWAIT_PROXY_HEADER;
+    if (sock.addrlen != cctx->downstream.sock.addrlen
+        || memcmp(&sock.addr, &cctx->downstream.sock.addr, sock.addrlen)) {
+        humanize_socket(&sock);
+        INFO("PROXY header: %s is %s", cctx->downstream.sock.to_string, sock.to_string);
+        cctx->downstream.sock = sock;
+
+        // accept_cb() skipped admission of load balancer's address
+        if (_admit_client(sctx, &sock)) {
+            _set_rst_on_close(cctx->downstream.io.fd);
+            cctx->reason = CLOSE_REJECTED;
+            return -1;
+        }
+    }
+
+    _track_client(sctx, cctx);
+    _capture_client(sctx, cctx);
+    return 1;
+}
+
+inline static
+ssize_t _read_downstream(client_ctx_t* cctx, int pipefd, size_t len)
+{
+    // downstream -> pipe, decrypting in userspace if there is no kTLS
+    tls_conn_t* tls = cctx->downstream.tls;
+    if (tls && !tls->ktls_rx)
+        return tls_splice_read(tls, pipefd, len);
+
+    return splice(cctx->downstream.io.fd, NULL,
+                  pipefd, NULL,
+                  len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+inline static
+int _flush_mirror_tap(client_ctx_t* cctx)
+{
+    // tap -> downstream pipe, return 0 if tap is empty afterwards
+    while (cctx->mirror.tap_size) {
+        ssize_t ret = splice(cctx->mirror.tapfd[0], NULL,
+                             cctx->downstream.pipefd[1], NULL,
+                             cctx->mirror.tap_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (ret > 0) {
+            cctx->mirror.tap_size -= ret;
+            cctx->downstream.size += ret;
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+inline static
+ssize_t _splice_from_downstream(server_ctx_t* sctx, client_ctx_t* cctx, size_t len)
+{
+    /* read new data into downstream pipe and account it there.
+     * Return amount of data read or splice()-like error.
+     *
+     * tee() always duplicates data from the head of a pipe, but downstream
+     * pipe may still keep data which was mirrored before. So while mirroring
+     * fresh data is read into an empty tap pipe, duplicated into mirror pipe
+     * and then moved (no copying either) to downstream pipe */
+
+    if (cctx->mirror.tapfd[0] < 0) {
+        ssize_t ret = _read_downstream(cctx, cctx->downstream.pipefd[1], len);
+        if (ret > 0) cctx->downstream.size += ret;
+        return ret;
+    }
+
+    if (_flush_mirror_tap(cctx)) {
+        errno = EAGAIN; // downstream pipe is full
+        return -1;
+    }
+
+    // mirror was stopped and tap is drained, read directly from now on
+    if (cctx->mirror.pipefd[0] < 0) {
+        close(cctx->mirror.tapfd[0]);
+        close(cctx->mirror.tapfd[1]);
+        cctx->mirror.tapfd[0] = cctx->mirror.tapfd[1] = -1;
+        return _splice_from_downstream(sctx, cctx, len);
+    }
+
+    ssize_t ret = _read_downstream(cctx, cctx->mirror.tapfd[1], len);
+    if (ret <= 0) return ret;
+
+    cctx->mirror.tap_size = ret;
+
+    // best effort, never wait for mirror
+    ssize_t teed = tee(cctx->mirror.tapfd[0], cctx->mirror.pipefd[1], ret, SPLICE_F_NONBLOCK);
+    if (teed < 0) teed = 0;
+
+    cctx->mirror.size += teed;
+    STAT_ADD(&sctx->stats, mirrored_bytes, teed);
+
+    if (teed < ret) {
+        // mirror is going to see a gap in stream, no sense to continue
+        STAT_ADD(&sctx->stats, mirror_dropped_bytes, ret - teed);
+        _D("mirror of %s fell behind, stop it", cctx->downstream.sock.to_string);
+        _stop_mirror(sctx, cctx);
+    }
+
+    _flush_mirror_tap(cctx);
+    return ret;
+}
+
+inline static
+int _downstream_input_pending(client_ctx_t* cctx)
+{
+    // data read from downstream but not yet in downstream pipe
+    return cctx->mirror.tap_size || tls_rx_pending(cctx->downstream.tls);
+}
+
+inline static
+void _init_mirror(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    // failures are not fatal, connection just won't be mirrored
+    if (!sctx->msock) return;
+
+    int fd = setup_socket(sctx->msock, 0);
+    if (fd < 0) return;
+
+    if (connect_client_socket(sctx->msock, fd) < 0) {
+        close(fd);
+        return;
+    }
+
+    if (pipe2(cctx->mirror.pipefd, O_NONBLOCK)) {
+        ERRP("Failed to create mirror pipe");
+        close(fd);
+        return;
+    }
+
+    if (pipe2(cctx->mirror.tapfd, O_NONBLOCK)) {
+        ERRP("Failed to create mirror tap pipe");
+        close(fd);
+        close(cctx->mirror.pipefd[0]);
+        close(cctx->mirror.pipefd[1]);
+        cctx->mirror.pipefd[0] = cctx->mirror.pipefd[1] = -1;
+        return;
+    }
+
+#ifdef F_SETPIPE_SZ
+    if (gl_settings.pipe_size) {
+        fcntl(cctx->mirror.pipefd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
+        fcntl(cctx->mirror.tapfd[0], F_SETPIPE_SZ, gl_settings.pipe_size);
+    }
+#endif
+
+    ev_io_init(&cctx->mirror.io, mirror_cb, fd, EV_READ | EV_WRITE);
+    ev_io_start(sctx->loop, &cctx->mirror.io);
+}
+
+inline static
+void _stop_mirror(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    /* tap pipe is not closed here since it may still
+     * keep downstream data, it's closed once drained */
+
+    if (cctx->mirror.io.fd >= 0) {
+        ev_io_stop(sctx->loop, &cctx->mirror.io);
+        close(cctx->mirror.io.fd);
+        cctx->mirror.io.fd = -1;
+    }
+
+    if (cctx->mirror.pipefd[0] >= 0) {
+        close(cctx->mirror.pipefd[0]);
+        close(cctx->mirror.pipefd[1]);
+        cctx->mirror.pipefd[0] = cctx->mirror.pipefd[1] = -1;
+    }
+
+    cctx->mirror.size = 0;
+    cctx->mirror.connected = 0;
+}
+
+inline static
+ssize_t _splice_to_downstream(client_ctx_t* cctx, size_t len)
+{
+    // pipe -> downstream, encrypting in userspace if there is no kTLS
+    tls_conn_t* tls = cctx->downstream.tls;
+    if (tls && !tls->ktls_tx)
+        return tls_splice_write(tls, cctx->upstream.pipefd[0], len);
+
+    return splice(cctx->upstream.pipefd[0], NULL,
+                  cctx->downstream.io.fd, NULL,
+                  len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+inline static
+size_t _global_rate_share()
+{
+    /* bucket with rate 0 would never let anything through
+     * nor tell how long to wait, limit under nproc bytes/sec
+     * is rounded up to 1 byte/sec per worker */
+    if (!gl_settings.rate_global) return 0;
+
+    size_t rate = gl_settings.rate_global / gl_settings.nproc;
+    return rate ? rate : 1;
+}
+
+inline static
+size_t _apply_bucket(token_bucket_t* tb, size_t rate, ev_tstamp now, size_t quota, ev_tstamp* wait)
+{
+    // burst is one second worth of traffic
+    size_t available = tb_available(tb, rate, rate, now);
+    size_t chunk = rate < RATE_MIN_CHUNK ? rate : RATE_MIN_CHUNK;
+
+    if (available < chunk) {
+        ev_tstamp t = tb_wait_time(tb, rate, chunk);
+        if (t > *wait) *wait = t;
+    }
+
+    return available < quota ? available : quota;
+}
+
+inline static
+size_t _rate_quota(server_ctx_t* sctx, client_ctx_t* cctx, int dir)
+{
+    /* return how much data can be read in given direction.
+     * 0 means that some limit is reached, in such case
+     * throttle timer is started to resume reading later */
+
+    if (!gl_settings.rate_conn && !gl_settings.rate_ip && !gl_settings.rate_global)
+        return MAX_SPLICE_AT_ONCE;
+
+    ev_tstamp wait = 0;
+    ev_tstamp now = ev_now(sctx->loop);
+    size_t quota = MAX_SPLICE_AT_ONCE;
+
+    if (gl_settings.rate_conn)
+        quota = _apply_bucket(&cctx->rate[dir], gl_settings.rate_conn, now, quota, &wait);
+
+    if (gl_settings.rate_global)
+        quota = _apply_bucket(&sctx->rate[dir], _global_rate_share(), now, quota, &wait);
+
+    if (gl_settings.rate_ip && (cctx->flags & CLIENT_IN_IP_TABLE)) {
+        ip_entry_t* e = ip_table_find(&sctx->clients, ip_key_from_socket(&cctx->downstream.sock));
+        if (e) quota = _apply_bucket(&e->rate[dir], gl_settings.rate_ip, now, quota, &wait);
+    }
+
+    if (wait == 0)
+        return quota;
+
+    if (!ev_is_active(&cctx->throttle)) {
+        ev_timer_set(&cctx->throttle, wait, 0.);
+        ev_timer_start(sctx->loop, &cctx->throttle);
+    }
+
+    return 0;
+}
+
+inline static
+void _rate_consume(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t amount)
+{
+    if (gl_settings.rate_conn)
+        tb_consume(&cctx->rate[dir], amount);
+
+    if (gl_settings.rate_global)
+        tb_consume(&sctx->rate[dir], amount);
+
+    if (gl_settings.rate_ip && (cctx->flags & CLIENT_IN_IP_TABLE)) {
+        ip_entry_t* e = ip_table_find(&sctx->clients, ip_key_from_socket(&cctx->downstream.sock));
+        if (e) tb_consume(&e->rate[dir], amount);
+    }
+}
+
+inline static
+size_t _quantum_quota(server_ctx_t* sctx, client_ctx_t* cctx, int dir, int revents, size_t quota)
+{
+    /* limit read by what's left of connection's quantum in current round.
+     * Return 0 if connection is still in debt (userspace TLS read a whole
+     * record), it's put back to deferred list and reading has to be
+     * paused by caller */
+
+    if (!gl_settings.quantum || !(revents & EV_READ))
+        return quota;
+
+    // connection wasn't backlogged, start new round
+    if (!(revents & EV_DEFERRED_CALL))
+        cctx->deficit[dir] = gl_settings.quantum;
+
+    if (cctx->deficit[dir] <= 0) {
+        _defer(sctx, cctx, dir == DIR_TO_UPSTREAM ? CLIENT_DEFERRED_DOWNSTREAM : CLIENT_DEFERRED_UPSTREAM);
+        STAT_ADD(&sctx->stats, deferred_reads, 1);
+        return 0;
+    }
+
+    return quota < (size_t) cctx->deficit[dir] ? quota : (size_t) cctx->deficit[dir];
+}
+
+inline static
+int _quantum_consume(server_ctx_t* sctx, client_ctx_t* cctx, int dir, size_t amount)
+{
+    /* charge read data to connection's deficit. Return 1 if quantum
+     * is used up and the connection was put into deferred list,
+     * in this case reading has to be paused by caller */
+
+    if (!gl_settings.quantum) return 0;
+
+    cctx->deficit[dir] -= amount;
+    if (cctx->deficit[dir] > 0) return 0;
+
+    _defer(sctx, cctx, dir == DIR_TO_UPSTREAM ? CLIENT_DEFERRED_DOWNSTREAM : CLIENT_DEFERRED_UPSTREAM);
+    STAT_ADD(&sctx->stats, deferred_reads, 1);
+    return 1;
+}
+
+inline static
+void _defer(server_ctx_t* sctx, client_ctx_t* cctx, int flag)
+{
+    // append connection to the tail of deferred list
+    int linked = cctx->flags & (CLIENT_DEFERRED_UPSTREAM | CLIENT_DEFERRED_DOWNSTREAM);
+    cctx->flags |= flag;
+    if (linked) return;
+
+    cctx->deferred_next = -1;
+    cctx->deferred_prev = sctx->deferred.tail;
+
+    if (sctx->deferred.tail >= 0) {
+        sctx->pool[sctx->deferred.tail].deferred_next = cctx->idx;
+    } else {
+        sctx->deferred.head = cctx->idx;
+    }
+
+    sctx->deferred.tail = cctx->idx;
+    sctx->deferred.count++;
+
+    if (!ev_is_active(&sctx->deferred.idle))
+        ev_idle_start(sctx->loop, &sctx->deferred.idle);
+}
+
+inline static
+void _undefer(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    // remove connection from deferred list, if it's there
+    if (!(cctx->flags & (CLIENT_DEFERRED_UPSTREAM | CLIENT_DEFERRED_DOWNSTREAM)))
+        return;
+
+    cctx->flags &= ~(CLIENT_DEFERRED_UPSTREAM | CLIENT_DEFERRED_DOWNSTREAM);
+
+    if (cctx->deferred_prev >= 0) {
+        sctx->pool[cctx->deferred_prev].deferred_next = cctx->deferred_next;
+    } else {
+        sctx->deferred.head = cctx->deferred_next;
+    }
+
+    if (cctx->deferred_next >= 0) {
+        sctx->pool[cctx->deferred_next].deferred_prev = cctx->deferred_prev;
+    } else {
+        sctx->deferred.tail = cctx->deferred_prev;
+    }
+
+    cctx->deferred_prev = cctx->deferred_next = -1;
+    sctx->deferred.count--;
+}
+
+inline static
+int _ip_tracking_enabled()
+{
+    return gl_settings.rate_ip || gl_settings.max_conn_per_ip || gl_settings.accept_rate_per_ip;
+}
+
+inline static
+double _accept_rate_share()
+{
+    // connections from an address are spread between workers by SO_REUSEPORT
+    return (double) gl_settings.accept_rate_per_ip / gl_settings.nproc;
+}
+
+inline static
+ip_entry_t* _get_ip_entry(server_ctx_t* sctx, ip_key_t key)
+{
+    // find or create entry in sctx->clients, NULL if failed to allocate memory
+    ip_entry_t* e = ip_table_insert(&sctx->clients, key);
+    if (!e) return NULL;
+
+    ev_tstamp now = ev_now(sctx->loop);
+    if (!e->last_seen) {
+        // new entry
+        double accept_rate = _accept_rate_share();
+        tb_init(&e->rate[DIR_TO_UPSTREAM], gl_settings.rate_ip, now);
+        tb_init(&e->rate[DIR_TO_DOWNSTREAM], gl_settings.rate_ip, now);
+        tb_init(&e->accepts, accept_rate < 1 ? 1 : accept_rate, now);
+    }
+
+    e->last_seen = now;
+    return e;
+}
+
+inline static
+int _admit_client(server_ctx_t* sctx, const socket_t* sock)
+{
+    /* accept-time admission control, return 0 if connection is allowed.
+     * Concurrent connections are counted across all workers (approximately),
+     * accept rate is enforced by each worker for its share */
+
+    const acl_t* acl = __atomic_load_n(&sctx->acl, __ATOMIC_ACQUIRE);
+    if (acl && !acl_allowed(acl, &sock->addr)) {
+        _D("reject %s: denied by ACL", sock->to_string);
+        STAT_ADD(&sctx->stats, rejected_acl, 1);
+        return -1;
+    }
+
+    if (!gl_settings.max_conn_per_ip && !gl_settings.accept_rate_per_ip)
+        return 0;
+
+    ip_key_t key = ip_key_from_socket(sock);
+
+    if (gl_settings.max_conn_per_ip
+        && sketch_estimate(&g_conns_per_ip, ip_key_hash(key)) >= gl_settings.max_conn_per_ip) {
+        _D("reject %s: too many connections", sock->to_string);
+        STAT_ADD(&sctx->stats, rejected_conn_limit, 1);
+        return -1;
+    }
+
+    if (gl_settings.accept_rate_per_ip) {
+        ip_entry_t* e = _get_ip_entry(sctx, key);
+        if (!e) return 0; // fail open
+
+        double accept_rate = _accept_rate_share();
+        if (tb_available(&e->accepts, accept_rate, accept_rate < 1 ? 1 : accept_rate, ev_now(sctx->loop)) < 1) {
+            _D("reject %s: too many new connections", sock->to_string);
+            STAT_ADD(&sctx->stats, rejected_accept_rate, 1);
+            return -1;
+        }
+
+        tb_consume(&e->accepts, 1);
+    }
+
+    return 0;
+}
+
+inline static
+void _set_rst_on_close(int fd)
+{
+    // zero linger timeout makes close() send RST and skip TIME_WAIT
+    struct linger linger = { 1, 0 };
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)))
+        ERRP("setsockopt(SO_LINGER) failed");
+}
+
+inline static
+void _epoll_busy_poll(int epfd)
+{
+    // make epoll_wait() busy poll device queues of sockets it waits for
+    char path[64], link[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", epfd);
+    ssize_t len = readlink(path, link, sizeof(link) - 1);
+    if (len < 0 || (link[len] = '\0', strcmp(link, "anon_inode:[eventpoll]") != 0)) {
+        ERR("Failed to find epoll fd of event loop, epoll busy polling is off");
+        return;
+    }
+
+    struct epoll_params params = {
+        .busy_poll_usecs = gl_settings.busy_poll,
+        .busy_poll_budget = 8,          // kernel's default (BUSY_POLL_BUDGET)
+        .prefer_busy_poll = 1,
+    };
+
+    if (ioctl(epfd, EPIOCSPARAMS, &params))
+        ERRP("ioctl(EPIOCSPARAMS) failed, Linux 6.9+ is required, epoll busy polling is off");
+}
+
+inline static
+int _tcp_info(int fd, struct tcp_info* info)
+{
+    socklen_t len = sizeof(*info);
+    return getsockopt(fd, IPPROTO_TCP, TCP_INFO, info, &len);
+}
+
+inline static
+void _track_client(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    // account connection in sctx->clients table
+    if (!_ip_tracking_enabled()) return;
+
+    ip_key_t key = ip_key_from_socket(&cctx->downstream.sock);
+    ip_entry_t* e = _get_ip_entry(sctx, key);
+    if (!e) {
+        ERR("Failed to grow clients table, %s is not tracked", cctx->downstream.sock.to_string);
+        return;
+    }
+
+    if (gl_settings.max_conn_per_ip)
+        sketch_add(&g_conns_per_ip, ip_key_hash(key), 1);
+
+    e->conns++;
+    cctx->flags |= CLIENT_IN_IP_TABLE;
+}
+
+inline static
+void _untrack_client(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    if (!(cctx->flags & CLIENT_IN_IP_TABLE)) return;
+    cctx->flags &= ~CLIENT_IN_IP_TABLE;
+
+    ip_key_t key = ip_key_from_socket(&cctx->downstream.sock);
+    ip_entry_t* e = ip_table_find(&sctx->clients, key);
+    assert(e && e->conns > 0);
+
+    if (gl_settings.max_conn_per_ip)
+        sketch_add(&g_conns_per_ip, ip_key_hash(key), -1);
+
+    // entry is removed by expire_clients_cb() later, so bucket survives reconnects
+    e->conns--;
+    e->last_seen = ev_now(sctx->loop);
+}
+
+inline static
+int grow_pool(server_ctx_t* sctx, size_t size)
+{
+    assert(sctx);
+
+    /* grow pool has O(n) complexety.
+     * But good news is that pushing to
+     * stack is very-very cache friendly */
+    _D("grow_pool to size %zd", size);
+
+    size_t old_size = 0;
+    int_stack_t* stack = NULL;
+
+    /* libev keeps pointers to watchers inside client_ctx_t,
+     * so pool can't be moved by realloc() while connections are alive.
+     * Allocate it for maxconn at once, the memory is backed by fresh
+     * anonymous pages which kernel provides only when they're touched */
+    if (!sctx->pool) {
+        sctx->pool = malloc(gl_settings.maxconn * sizeof(client_ctx_t));
+        if (!sctx->pool) {
+            ERR("Failed to allocate pool");
+            return -1;
+        }
+    }
+
+    if (size > gl_settings.maxconn)
+        size = gl_settings.maxconn;
+
+    if (sctx->stack) {
+        old_size = sctx->stack->size;
+        stack = stack_grow(sctx->stack, size);
+    } else {
+        stack = stack_init(size);
+    }
+
+    if (!stack) {
+        ERR("Failed to grow stack");
+        return -1;
+    }
+
+    _D("fill stack with items from %zd to %zd", size - 1, old_size);
+    for (int i = size - 1; i >= (int) old_size; --i) {
+        sctx->pool[i].downstream.io.fd = -1; // not in use, see _capture_start()
+        stack_push(stack, i);
+    }
+
+    sctx->stack = stack;
+    return 0;
+}
+
+inline static
+void _add_client(server_ctx_t* sctx, client_ctx_t* cctx, int fd)
+{
+    // accepted connection is admitted, serve it in this worker
+    socket_t* sock = &cctx->downstream.sock;
+    humanize_socket(sock);
+
+    if (init_client_ctx(sctx, cctx, fd)) {
+        // upstream problems shouldn't affect listening socket
+        close(fd);
+        return;
+    }
+
+    _mark_client_ctx_as_used(sctx, cctx);
+    _D("assigned idx %d to client_ctx_t for %s", cctx->idx, sock->to_string);
+
+    INFO("accepted connection from %s", sock->to_string);
+}
+
+inline static
+size_t _load(server_ctx_t* sctx)
+{
+    // connections weighted by how busy loop is, i.e. x2 for fully busy one
+    size_t conns = STAT_GET(&sctx->stats, active_conns);
+    size_t busy = STAT_GET(&sctx->stats, loop_busy_permille);
+    return conns * (1000 + busy) / 1000;
+}
+
+inline static
+int _handoff(server_ctx_t* sctx, int fd, const socket_t* sock)
+{
+    /* pass connection to the least loaded worker if this one is loaded
+     * noticeably more. Return -1 if connection stays here */
+    server_ctx_t* target = NULL;
+    size_t own = _load(sctx), best = own;
+    size_t count = __atomic_load_n(&g_sctxs_count, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t load = _load(&g_sctxs[i]);
+        if (&g_sctxs[i] != sctx && load < best) {
+            target = &g_sctxs[i];
+            best = load;
+        }
+    }
+
+    if (!target || own <= best + best / 2 + REBALANCE_SLACK)
+        return -1;
+
+    if (handoff_push(&target->rebalance.queue, fd, sock))
+        return -1;
+
+    STAT_ADD(&sctx->stats, handoffs_out, 1);
+    ev_async_send(target->loop, &target->rebalance.async);
+    return 0;
+}
+
+inline static
+client_ctx_t* _get_client_ctx(server_ctx_t* sctx)
+{
+    /* _get_client_ctx() has ammortized O(1) complexity
+     * i.e. we need to scan N items no often then N calls of _get_client_ctx() */
+
+    assert(sctx);
+    assert(sctx->stack);
+
+    int idx = stack_peek(sctx->stack);
+    if (idx < 0 && sctx->stack->size < gl_settings.maxconn) {
+        grow_pool(sctx, sctx->stack->size * 2 + 1); // + 1 to hanle size == 0
+        idx = stack_peek(sctx->stack);
+    }
+
+    assert(idx < sctx->stack->size);
+    return idx >= 0 ? &sctx->pool[idx] : NULL;
+}
+
+inline static
+void _mark_client_ctx_as_used(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    assert(sctx);
+    assert(cctx);
+    assert(sctx->stack);
+    assert(!stack_empty(sctx->stack));
+
+    cctx->idx = stack_pop(sctx->stack);
+    assert(cctx->idx >= 0);
+    assert(cctx->idx < sctx->stack->size);
+    STAT_ADD(&sctx->stats, active_conns, 1);
+}
+
+inline static
+void _mark_client_ctx_as_free(server_ctx_t* sctx, client_ctx_t* cctx)
+{
+    assert(sctx);
+    assert(cctx);
+    assert(sctx->stack);
+    assert(cctx->idx >= 0);
+    assert(!stack_full(sctx->stack));
+
+    stack_push(sctx->stack, cctx->idx);
+    STAT_ADD(&sctx->stats, active_conns, -1);
+    // TODO shrink pool
+}
+
+inline static
+size_t _pending_events(server_ctx_t* sctx)
+{
+    // pending watchers except the ones which are pending every iteration anyway
+    return ev_pending_count(sctx->loop)
+         - ev_is_pending(&sctx->deferred.check)
+         - ev_is_pending(&sctx->deferred.idle)
+         - ev_is_pending(&sctx->busy.check)
+         - ev_is_pending(&sctx->busy.spin)
+         - ev_is_pending(&sctx->collect.check)
+         - ev_is_pending(&sctx->loop_stats.check)
+         - (gl_settings.rebalance && ev_is_pending(&sctx->rebalance.check));
+}
+
+inline static
+void _loop_hist_add(loop_hist_t* hist, size_t val)
+{
+    size_t bucket = val ? 64 - __builtin_clzll(val) : 0;
+    hist->buckets[bucket < LOOP_HIST_BUCKETS ? bucket : LOOP_HIST_BUCKETS - 1]++;
+    if (val > hist->max) hist->max = val;
+}
+
+inline static
+void _admin_loop(server_ctx_t* sctx, FILE* out)
+{
+    if (!gl_settings.loop_stats) {
+        fprintf(out, "error: loop requires --loop-stats\n");
+        return;
+    }
+
+    const struct { const char* name; const loop_hist_t* hist; } hists[] = {
+        { "iteration_us", &sctx->loop_stats.iteration_us },
+        { "blocked_us",   &sctx->loop_stats.blocked_us },
+        { "callbacks_us", &sctx->loop_stats.callbacks_us },
+        { "events",       &sctx->loop_stats.events },
+        { "lag_us",       &sctx->loop_stats.lag_us },
+    };
+
+    // non-empty buckets by their (exclusive) upper bound, last one has none
+    for (size_t i = 0; i < sizeof(hists) / sizeof(hists[0]); ++i) {
+        const loop_hist_t* hist = hists[i].hist;
+        fprintf(out, "worker=%zu loop %s max=%zu", sctx->worker, hists[i].name, hist->max);
+
+        for (size_t b = 0; b < LOOP_HIST_BUCKETS; ++b) {
+            if (!hist->buckets[b]) continue;
+            if (b == LOOP_HIST_BUCKETS - 1) {
+                fprintf(out, " >=%zu:%zu", (size_t) 1 << (b - 1), hist->buckets[b]);
+            } else {
+                fprintf(out, " <%zu:%zu", (size_t) 1 << b, hist->buckets[b]);
+            }
+        }
+
+        fprintf(out, "\n");
+    }
+}
@@ -1,15 +1,93 @@
 #ifndef __SERVER_CTX_H__
 #define __SERVER_CTX_H__
 
+#include "acl.h"
 #include "net.h"
+#include "tls.h"
 #include "stack.h"
+#include "stats.h"
+#include "udp.h"
+#include "handoff.h"
+#include "access_log.h"
+#include "capture.h"
+#include "ip_table.h"
+#include "token_bucket.h"
 #include "libev/ev.h"
 
+#define CLIENT_AWAIT_PROXY_HEADER 0x1     // PROXY header not yet read from downstream
+#define CLIENT_TLS_HANDSHAKE      0x2     // TLS handshake with downstream in progress
+#define CLIENT_THROTTLED_UPSTREAM   0x4   // reading from upstream paused by rate limit
+#define CLIENT_THROTTLED_DOWNSTREAM 0x8   // reading from downstream paused by rate limit
+#define CLIENT_IN_IP_TABLE        0x10    // counted in server_ctx_t.clients
+#define CLIENT_DEFERRED_UPSTREAM    0x20  // reading from upstream waits in deferred queue
+#define CLIENT_DEFERRED_DOWNSTREAM  0x40  // reading from downstream waits in deferred queue
+#define CLIENT_FASTOPEN             0x80  // upstream SYN is sent with first data (TCP Fast Open)
+#define CLIENT_LAZY                 0x100 // upstream isn't connected until downstream sends something
+#define CLIENT_CAPTURE              0x200 // data is copied to capture file (--capture)
+
+#define TRANSPARENT_REDIRECT 1           // iptables REDIRECT, destination from conntrack (SO_ORIGINAL_DST)
+#define TRANSPARENT_TPROXY   2           // iptables TPROXY, destination is local address of socket
+
+#define ACCEPT_REUSEPORT 0               // every worker has own listening socket (SO_REUSEPORT)
+#define ACCEPT_SHARED    1               // workers accept from one listening socket
+
+#define DST_CACHE_SIZE 256               // original destinations remembered per worker (power of 2)
+#define MAX_DRAINED    16                // upstream addresses drained at once (admin socket)
+#define PROFILE_MAX_ROUTES 64            // upstream addresses --cpu-profile keeps apart, rest share one entry
+#define LOOP_HIST_BUCKETS  24            // log2 buckets of --loop-stats histograms, last one takes the rest
+#define LOOP_LAG_INTERVAL  0.1           // seconds between loop lag probes
+
+// admin_msg_t.cmd
+#define ADMIN_CONNS   1                  // list connections
+#define ADMIN_KILL    2                  // close connection idx
+#define ADMIN_DRAIN   3                  // don't connect new clients to addresses in set
+#define ADMIN_UNDRAIN 4
+#define ADMIN_CAPTURE 5                  // start (enable) or stop --capture with filter
+#define ADMIN_PROFILE 6                  // idx heaviest connections and routes by --cpu-profile
+#define ADMIN_LOOP    7                  // --loop-stats histograms
+
+// direction of data, index in token_bucket_t and deficit arrays
+#define DIR_TO_UPSTREAM   0
+#define DIR_TO_DOWNSTREAM 1
+
 typedef void (io_watcher_cb)(struct ev_loop* loop, ev_io *w, int revents);
 
+/* command from admin socket, executed by worker in its own loop.
+ * Reply is written to memory stream, worker sets done when it's ready */
+typedef struct {
+    int cmd;                            // ADMIN_*
+    size_t idx;                         // pool index of connection
+    const socket_set_t* set;            // addresses to drain/undrain
+    int enable;
+    capture_filter_t filter;
+    char* reply;                        // malloc()'ed by open_memstream()
+    size_t reply_len;
+    int done;
+} admin_msg_t;
+
+// CPU cost of connections to one upstream address (--cpu-profile)
+typedef struct {
+    socket_t sock;                      // addrlen is 0 for connections which never reached upstream
+    uint64_t cycles;
+    size_t conns;
+} profile_route_t;
+
+/* values counted by power of 2: bucket 0 is value 0,
+ * bucket b is [2^(b-1), 2^b) */
+typedef struct {
+    size_t buckets[LOOP_HIST_BUCKETS];
+    size_t max;
+} loop_hist_t;
+
 typedef struct _client_ctx {
     struct upstream {
-        ev_io io;
+        ev_io io;                       // connection (or first connection attempt)
+        ev_io race;                     // concurrent connection attempt (Happy Eyeballs)
+        ev_timer stagger;               // starts next attempt if current ones take too long
+        socket_set_t* uset;             // addresses being tried, referenced until connected
+        size_t next_addr;               // index of next address in uset to try
+        size_t race_addr;               // index of address race is connecting to
+        socket_t sock;                  // address io is connected (connecting) to
         int pipefd[2];                  // upstream -> pipe -> downstream
         size_t size;                    // amount of data kept in pipe's buffer
     } upstream;
@@ -19,27 +97,171 @@ typedef struct _client_ctx {
         int pipefd[2];                  // downstream -> pipe -> upstream
         size_t size;                    // amount of data kept in pipe's buffer
         socket_t sock;
+        char* header;                   // partially received PROXY header
+        size_t header_size;
+        tls_conn_t* tls;                // TLS state, NULL for plain connections
     } downstream;
 
+    struct mirror {
+        ev_io io;                       // shadow upstream, its responses are discarded
+        int pipefd[2];                  // tee() copy of downstream data -> shadow upstream
+        int tapfd[2];                   // downstream -> tap -> downstream pipe, keeps only fresh data for tee()
+        size_t size;                    // amount of data kept in pipe's buffer
+        size_t tap_size;                // amount of data kept in tap's buffer
+        int connected;
+    } mirror;
+
+    token_bucket_t rate[2];             // per connection bandwidth limit
+    ev_timer throttle;                  // resumes reading paused by rate limits
+
+    ssize_t deficit[2];                 // bytes left to read in current round (quantum)
+    int deferred_prev;                  // links in server_ctx_t.deferred list (pool indexes)
+    int deferred_next;
+
+    // --access-log accounting
+    uint64_t bytes[2];                  // read from each side, indexed by direction
+    ev_tstamp start;
+    ev_tstamp connected;                // 0 until upstream is connected
+    int reason;                         // CLOSE_* set before deinit_client_ctx()
+
+    size_t captured[2];                 // bytes at head of relay pipes which are captured already
+    uint64_t cycles;                    // estimated CPU cycles spent in callbacks (--cpu-profile)
+
     unsigned int idx;
+    unsigned int flags;                 // CLIENT_* flags
 } client_ctx_t;
 
 typedef struct {
     ev_io io;                           // watcher, used only to accept() connections
     ev_async stop_loop;                 // signal to interrupt loop
+    ev_async wakeup;                    // makes loop pass quiescent state (see epoch)
+    ev_prepare quiescent;               // bumps epoch once per loop iteration
+    size_t epoch;                       // changes once loop doesn't reference old acl/uset
     struct ev_loop *loop;               // thread EV loop
+    size_t worker;                      // index of this worker
 
     const socket_t* ssock;              // server socket_t (shared between threads)
-    const socket_t* usock;              // upstream socket_t (shared between threads)
+    socket_set_t* uset;                 // upstream addresses (shared), swapped by resolver thread, NULL in transparent mode
+    const socket_t* msock;              // mirror upstream socket_t (shared, optional)
+    acl_t* acl;                         // allow/deny rules (shared, optional), swapped by main thread
+    const socket_set_t* sources;        // source addresses of upstream connections (shared, optional)
+    size_t next_source;                 // round robin over sources
+    uint32_t port_range;                // IP_LOCAL_PORT_RANGE value (hi << 16 | lo), 0 - kernel default
 
     client_ctx_t* pool;                 // preallocated pool of client_ctx_t objects
     int_stack_t* stack;                 // stack of free indexes in pool
+
+    ip_table_t clients;                 // per client address state (rate limits)
+    token_bucket_t rate[2];             // this worker's share of global bandwidth limit
+    ev_timer expire_clients;            // periodically drops idle entries from clients
+
+    struct deferred {
+        ev_check check;                 // runs one round of deferred reads per loop iteration
+        ev_idle idle;                   // keeps loop from blocking while list isn't empty
+        int head;                       // list of client_ctx_t which used up their quantum
+        int tail;
+        size_t count;
+    } deferred;
+
+    struct busy {
+        ev_check check;                 // tells empty loop iterations from ones doing work
+        ev_idle spin;                   // keeps loop from blocking while spinning (--busy-spin)
+        ev_tstamp last_work;
+        ev_tstamp last_check;
+        double empty;                   // seconds spent in empty iterations
+    } busy;
+
+    struct collect {
+        ev_check check;                 // counts events per loop iteration
+        ev_timer tune;                  // adjusts io collect interval to them
+        size_t wakeups;                 // since last tune
+        size_t events;
+        double batch;                   // events per wakeup in previous period
+        size_t hold;                    // periods to wait before trying to batch again
+        ev_tstamp interval;
+    } collect;
+
+    struct rebalance {
+        handoff_queue_t queue;          // connections accepted by other workers
+        ev_async async;                 // queue isn't empty
+        ev_prepare prepare;             // together with check measures time loop is blocked
+        ev_check check;
+        ev_tstamp poll_start;
+        ev_tstamp window_start;
+        ev_tstamp blocked;              // in current window
+    } rebalance;
+
+    access_ring_t access;               // records of closed connections (--access-log), drained by logger thread
+
+    struct capture {
+        ev_async toggle;                // main thread changed enabled
+        int enabled;
+        int active;                     // worker applied enabled
+        capture_filter_t filter;        // clients to capture
+        int pipefd[2];                  // relay pipes are tee()'d here, writer thread splices it to file
+        capture_ring_t ring;            // headers of data in pipe, in the same order
+    } capture;
+
+    struct admin {
+        ev_async async;                 // msg is posted
+        admin_msg_t* msg;               // taken by worker, main thread waits for msg->done
+    } admin;
+
+    socket_t drained[MAX_DRAINED];      // upstream addresses new connections avoid
+    size_t drained_count;
+
+    struct profile {
+        size_t countdown;               // callbacks until next sample
+        profile_route_t routes[PROFILE_MAX_ROUTES]; // closed connections
+        size_t routes_count;
+    } profile;
+
+    struct loop_stats {
+        ev_prepare prepare;             // right before poll
+        ev_check check;                 // right after it, callbacks follow
+        ev_timer lag;                   // probe showing how late loop runs due timers
+        ev_tstamp poll_start;           // time of prepare
+        ev_tstamp poll_end;             // time of check, 0 before first one
+        ev_tstamp lag_due;
+        ev_tstamp blocked;              // totals since start
+        ev_tstamp callbacks;
+        loop_hist_t iteration_us;       // prepare to prepare
+        loop_hist_t blocked_us;         // in poll
+        loop_hist_t callbacks_us;       // running callbacks
+        loop_hist_t events;             // watchers pending after poll
+        loop_hist_t lag_us;
+    } loop_stats;
+
+    udp_ctx_t udp;                      // used instead of accept_cb() and client_ctx_t in UDP mode
+
+    // transparent mode: direct-mapped cache of upstream addresses,
+    // saves allocation per connection to popular destinations
+    socket_set_t* dst_cache[DST_CACHE_SIZE];
+
+    server_stats_t stats;
 } server_ctx_t;
 
-int init_server_ctx(server_ctx_t* sctx, const socket_t* ssock, const socket_t* usock);
+// create listening socket with options given in command line
+int setup_server_socket(const socket_t* ssock);
+
+/* if lfd >= 0 it's listening socket shared by all workers (each gets
+ * own dup()), otherwise every worker binds ssock with SO_REUSEPORT.
+ * Call it for all workers before starting threads, see --busy-poll */
+int init_server_ctx(server_ctx_t* sctx, const socket_t* ssock, int lfd, socket_set_t* uset, const socket_t* msock);
 void terminate_server_ctx(server_ctx_t* sctx);
+void wakeup_server_ctx(server_ctx_t* sctx);
 void free_server_ctx(server_ctx_t* sctx);
 
+// all workers, --rebalance hands connections off between them
+void set_server_ctxs(server_ctx_t* sctxs, size_t count);
+
+// start or stop --capture, worker applies it asynchronously
+void capture_server_ctx(server_ctx_t* sctx, int enable);
+
+/* run admin command in worker, return 0 once it's done. Return -1 if
+ * worker didn't run it in 1s, msg is leaked then if worker has taken it */
+int admin_server_ctx(server_ctx_t* sctx, admin_msg_t* msg);
+
 int init_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx, int fd);
 void deinit_client_ctx(server_ctx_t* sctx, client_ctx_t* cctx);
 
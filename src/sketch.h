@@ -0,0 +1,47 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stdint.h>
+
+/* count-min sketch shared by all workers. Each key maps to one
+ * counter per row, estimate is the minimum of them, so it never
+ * underestimates (as long as every add is matched by remove).
+ * Counters are updated with relaxed atomics, there are no locks
+ * and no per-key memory. 4 x 16K counters = 256KB */
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH (1 << 14)
+
+typedef struct {
+    unsigned int counters[SKETCH_DEPTH][SKETCH_WIDTH];
+} count_sketch_t;
+
+inline static
+size_t _sketch_slot(uint64_t hash, int row)
+{
+    // double hashing, rows are independent enough for small depth
+    uint32_t h1 = (uint32_t) hash;
+    uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+    return (h1 + row * h2) & (SKETCH_WIDTH - 1);
+}
+
+inline static
+void sketch_add(count_sketch_t* s, uint64_t hash, int delta)
+{
+    for (int row = 0; row < SKETCH_DEPTH; ++row)
+        __atomic_add_fetch(&s->counters[row][_sketch_slot(hash, row)], delta, __ATOMIC_RELAXED);
+}
+
+inline static
+unsigned int sketch_estimate(count_sketch_t* s, uint64_t hash)
+{
+    unsigned int min = (unsigned int) -1;
+    for (int row = 0; row < SKETCH_DEPTH; ++row) {
+        unsigned int val = __atomic_load_n(&s->counters[row][_sketch_slot(hash, row)], __ATOMIC_RELAXED);
+        if (val < min) min = val;
+    }
+
+    return min;
+}
+
+#endif
@@ -27,9 +27,9 @@ int_stack_t* stack_grow(int_stack_t* s, size_t size)
     if (!size) return s;
     int new_size = sizeof(int_stack_t) + (sizeof(int) * size);
     int_stack_t* stack = (int_stack_t*) realloc(s, new_size);
-    if (!stack) return s;
+    if (!stack) return NULL; // s is still valid
 
-    s->size = size;
+    stack->size = size;
     return stack;
 }
 
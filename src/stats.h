@@ -0,0 +1,84 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+/* per-worker counters. Written only by owning thread
+ * and read by main thread to print them. Relaxed atomic
+ * store/load avoid torn values without locked instructions
+ * on data path. To add a counter just extend the list */
+#define SERVER_STATS(X)                                                        \
+    X(mirrored_bytes)           /* bytes tee()'d to mirror upstream */         \
+    X(mirror_dropped_bytes)     /* bytes not mirrored since mirror was full */ \
+    X(deferred_reads)           /* reads postponed after using up quantum */   \
+    X(rejected_acl)             /* connections denied by --acl rules */        \
+    X(rejected_conn_limit)      /* connections over --max-conn-per-ip */       \
+    X(rejected_accept_rate)     /* connections over --accept-rate-per-ip */   \
+    X(udp_from_clients)         /* datagrams received from clients */          \
+    X(udp_to_upstream)          /* and sent to upstream */                     \
+    X(udp_from_upstream)        /* datagrams received from upstream */         \
+    X(udp_to_clients)           /* and sent back to clients */                 \
+    X(udp_dropped)              /* datagrams dropped (no flow, full buffer) */ \
+    X(udp_flows)                /* UDP flows created */                        \
+    X(upstream_connects)        /* connect() attempts to upstream */           \
+    X(upstream_addr_unavail)    /* attempts failed for lack of source port */  \
+    X(upstream_rst_closes)      /* upstream sockets closed with RST */         \
+    X(fastopen_accepted)        /* downstream SYNs carrying data accepted */   \
+    X(fastopen_connects)        /* upstream SYNs carrying data acked */        \
+    X(fastopen_fallbacks)       /* upstream connects without cookie */         \
+    X(lazy_unpaired)            /* clients gone before sending anything */     \
+    X(spin_empty_us)            /* time of spinning polls finding nothing */   \
+    X(spin_work)                /* spinning polls which found events */        \
+    X(spin_sleeps)              /* times worker stopped spinning and blocked */ \
+    X(loop_wakeups)             /* loop iterations which found events */       \
+    X(loop_events)              /* events they found, see loop_wakeups */      \
+    X(io_collect_us)            /* current io collect interval */              \
+    X(active_conns)             /* connections being served */                 \
+    X(loop_busy_permille)       /* share of time loop is busy (--rebalance) */ \
+    X(handoffs_out)             /* connections handed off to other workers */  \
+    X(handoffs_in)              /* and taken from them */                      \
+    X(accept_races)             /* wakeups when other worker accepted first */ \
+    X(access_log_drops)         /* access records lost, logger fell behind */  \
+    X(captured_bytes)           /* bytes tee()'d to capture pipe */            \
+    X(capture_drops)            /* chunks relayed without being captured */    \
+    X(profile_samples)          /* callbacks measured by --cpu-profile */      \
+    X(loop_iterations)          /* loop iterations (--loop-stats) */           \
+    X(loop_blocked_us)          /* time they spent blocked in poll */          \
+    X(loop_callbacks_us)        /* and running callbacks */                    \
+    X(loop_lag_us)              /* delay of the last loop lag probe */
+
+typedef struct {
+#define X(name) size_t name;
+    SERVER_STATS(X)
+#undef X
+} server_stats_t;
+
+/* upstream resolver counters, written by resolver thread */
+#define RESOLVER_STATS(X)                                                      \
+    X(resolves)                 /* getaddrinfo() calls */                      \
+    X(resolve_failures)         /* failed ones, previous addresses are kept */ \
+    X(resolve_last_us)          /* latency of the last one */                  \
+    X(resolve_max_us)           /* and the slowest one */                      \
+    X(upstream_changes)         /* times new address set was published */
+
+typedef struct {
+#define X(name) size_t name;
+    RESOLVER_STATS(X)
+#undef X
+} resolver_stats_t;
+
+/* buffer size for " name=value" of every counter of a list, e.g.
+ * char buf[STATS_LINE_SIZE(SERVER_STATS)], 20 is digits of SIZE_MAX */
+#define STAT_LINE_SIZE(name) + sizeof(" " #name "=") + 20
+#define STATS_LINE_SIZE(LIST) (1 LIST(STAT_LINE_SIZE))
+
+#define STAT_SET(stats, name, val) \
+    __atomic_store_n(&(stats)->name, (val), __ATOMIC_RELAXED)
+
+#define STAT_ADD(stats, name, val) \
+    __atomic_store_n(&(stats)->name, (stats)->name + (val), __ATOMIC_RELAXED)
+
+#define STAT_GET(stats, name) \
+    __atomic_load_n(&(stats)->name, __ATOMIC_RELAXED)
+
+#endif
@@ -1,13 +1,22 @@
+#include <time.h>
+#include <getopt.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/un.h>
 
 #include "net.h"
 #include "config.h"
 #include "common.h"
 #include "server_ctx.h"
+#include "proxy_protocol.h"
+#include "tls.h"
+#include "acl.h"
+#include "access_log.h"
+#include "admin.h"
 
 // see commnect in config.h
 GLOBAL gl_settings;
+int gl_log_level = LOGLEVEL_INFO;
 
 pthread_t start_thread(void *(*routine) (void*), void* arg)
 {
@@ -30,10 +39,500 @@ void* run_event_loop(void* arg)
     return NULL;
 }
 
+void usage(const char* prog)
+{
+    fprintf(stderr,
+        "usage: %s [options] <local host:port|unix:path> <upstream host:port|unix:path>\n"
+        "       %s --transparent=redirect|tproxy [options] <local host:port>\n"
+        "options:\n"
+        "  --send-proxy=v1|v2     prepend PROXY protocol header to upstream stream\n"
+        "  --accept-proxy         expect PROXY protocol v1/v2 header from clients\n"
+        "  --tls-cert=FILE        terminate TLS from clients using PEM certificate chain\n"
+        "  --tls-key=FILE         PEM private key (default: same file as --tls-cert)\n"
+        "  --mirror=HOST:PORT     copy client->upstream traffic to shadow upstream (best effort)\n"
+        "  --stats-interval=SEC   periodically print per-worker stats\n"
+        "  --rate-conn=BYTES      limit bandwidth per connection and direction (K/M/G suffixes)\n"
+        "  --rate-ip=BYTES        limit bandwidth per client address and direction\n"
+        "  --rate-global=BYTES    limit total bandwidth per direction\n"
+        "  --acl=FILE             allow/deny client addresses by CIDR rules, reloaded on SIGHUP\n"
+        "  --max-conn-per-ip=N    limit concurrent connections per client address\n"
+        "  --accept-rate-per-ip=N limit new connections per second per client address\n"
+        "  --quantum=BYTES        max bytes moved per connection and direction in one loop iteration\n"
+        "  --resolve-interval=SEC resolve upstream host again periodically (default: only at start)\n"
+        "  --udp                  relay UDP datagrams instead of TCP connections\n"
+        "  --udp-gro              batch datagrams with UDP_GRO/UDP_SEGMENT (Linux 5.0+)\n"
+        "  --udp-timeout=SEC      close idle UDP flows (default: 30)\n"
+        "  --transparent=MODE     connect to original destination of connections intercepted\n"
+        "                         by iptables REDIRECT or TPROXY rule\n"
+        "  --spoof-source         connect to upstream from client's address (IP_TRANSPARENT)\n"
+        "  --source=IP[,IP...]    connect to upstream from these addresses in round robin\n"
+        "  --partition-ports      give each worker own slice of ephemeral ports (Linux 6.3+)\n"
+        "  --upstream-rst         close upstream with RST to avoid TIME_WAIT\n"
+        "  --fastopen             TCP Fast Open on listener and upstream connections\n"
+        "  --defer-accept=SEC     accept connections once client has sent data (TCP_DEFER_ACCEPT)\n"
+        "  --lazy-connect         connect to upstream only when client has sent something\n"
+        "  --busy-poll=USEC       busy poll device queues from sockets and epoll (SO_BUSY_POLL)\n"
+        "  --busy-spin=USEC       keep event loop spinning for USEC after last event\n"
+        "  --collect-budget=USEC  batch events under load, delaying them at most USEC\n"
+        "  --rebalance            hand accepted connections off to less loaded workers\n"
+        "  --accept-model=MODEL   reuseport: listening socket per worker (default),\n"
+        "                         shared: idle workers accept from one socket\n"
+        "  --access-log=FILE      write binary record of every closed connection to FILE\n"
+        "  --access-log-size=BYTES\n"
+        "                         rotate access log to FILE.1 at this size (default: 100M)\n"
+        "  --capture=PREFIX       SIGUSR2 starts/stops capturing client data to PREFIX.<worker>\n"
+        "  --capture-filter=ADDR[/LEN]\n"
+        "                         capture only these clients (default: all)\n"
+        "  --admin=PATH           unix socket accepting commands (try: echo help | nc -U PATH)\n"
+        "  --cpu-profile=N        measure CPU cycles of 1 in N connection callbacks\n"
+        "  --loop-stats           time event loop iterations, see loop_* stats and admin 'loop'\n"
+        "  -h, --help             show this help\n",
+        prog, prog);
+}
+
+static const char* g_mirror = NULL;
+static const char* g_source = NULL;
+static const char* g_capture_filter = NULL;
+
+typedef struct {
+    const char* host;                   // upstream as given in command line
+    server_ctx_t* sctxs;
+    size_t count;
+    resolver_stats_t stats;
+} resolver_t;
+
+static resolver_t g_resolver;
+
+size_t parse_size(const char* str)
+{
+    // number with optional K, M or G suffix (powers of 1024)
+    char* end = NULL;
+    unsigned long long val = strtoull(str, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': val <<= 10; end++; break;
+        case 'm': case 'M': val <<= 20; end++; break;
+        case 'g': case 'G': val <<= 30; end++; break;
+    }
+
+    if (end == str || *end != '\0')
+        ERRX("Invalid size '%s'", str);
+
+    return val;
+}
+
+void parse_options(int argc, char** argv)
+{
+    static struct option long_options[] = {
+        { "send-proxy",         required_argument, NULL, 'P' },
+        { "accept-proxy",       no_argument,       NULL, 'A' },
+        { "tls-cert",           required_argument, NULL, 'C' },
+        { "tls-key",            required_argument, NULL, 'K' },
+        { "mirror",             required_argument, NULL, 'M' },
+        { "stats-interval",     required_argument, NULL, 'S' },
+        { "rate-conn",          required_argument, NULL, 'r' },
+        { "rate-ip",            required_argument, NULL, 'i' },
+        { "rate-global",        required_argument, NULL, 'g' },
+        { "acl",                required_argument, NULL, 'L' },
+        { "max-conn-per-ip",    required_argument, NULL, 'c' },
+        { "accept-rate-per-ip", required_argument, NULL, 'a' },
+        { "quantum",            required_argument, NULL, 'q' },
+        { "resolve-interval",   required_argument, NULL, 'R' },
+        { "udp",                no_argument,       NULL, 'U' },
+        { "udp-gro",            no_argument,       NULL, 'G' },
+        { "udp-timeout",        required_argument, NULL, 'T' },
+        { "transparent",        required_argument, NULL, 't' },
+        { "spoof-source",       no_argument,       NULL, 's' },
+        { "source",             required_argument, NULL, 'o' },
+        { "partition-ports",    no_argument,       NULL, 'p' },
+        { "upstream-rst",       no_argument,       NULL, 'x' },
+        { "fastopen",           no_argument,       NULL, 'F' },
+        { "defer-accept",       required_argument, NULL, 'D' },
+        { "lazy-connect",       no_argument,       NULL, 'z' },
+        { "busy-poll",          required_argument, NULL, 'b' },
+        { "busy-spin",          required_argument, NULL, 'B' },
+        { "collect-budget",     required_argument, NULL, 'k' },
+        { "rebalance",          no_argument,       NULL, 'E' },
+        { "accept-model",       required_argument, NULL, 'm' },
+        { "access-log",         required_argument, NULL, 'l' },
+        { "access-log-size",    required_argument, NULL, 'Z' },
+        { "capture",            required_argument, NULL, 'Y' },
+        { "capture-filter",     required_argument, NULL, 'y' },
+        { "admin",              required_argument, NULL, 'n' },
+        { "cpu-profile",        required_argument, NULL, 'u' },
+        { "loop-stats",         no_argument,       NULL, 'j' },
+        { "help",               no_argument,       NULL, 'h' },
+        { NULL,                 0,                 NULL,  0  }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'P':
+                if (strcmp(optarg, "v1") == 0) {
+                    gl_settings.send_proxy = PROXY_PROTOCOL_V1;
+                } else if (strcmp(optarg, "v2") == 0) {
+                    gl_settings.send_proxy = PROXY_PROTOCOL_V2;
+                } else {
+                    ERRX("Unknown PROXY protocol version '%s', expected v1 or v2", optarg);
+                }
+                break;
+
+            case 'A':
+                gl_settings.accept_proxy = 1;
+                break;
+
+            case 'C':
+                gl_settings.tls_cert = optarg;
+                break;
+
+            case 'K':
+                gl_settings.tls_key = optarg;
+                break;
+
+            case 'M':
+                g_mirror = optarg;
+                break;
+
+            case 'S':
+                gl_settings.stats_interval = atoll(optarg);
+                break;
+
+            case 'r':
+                gl_settings.rate_conn = parse_size(optarg);
+                break;
+
+            case 'i':
+                gl_settings.rate_ip = parse_size(optarg);
+                break;
+
+            case 'g':
+                gl_settings.rate_global = parse_size(optarg);
+                break;
+
+            case 'L':
+                gl_settings.acl_file = optarg;
+                break;
+
+            case 'c':
+                gl_settings.max_conn_per_ip = atoll(optarg);
+                break;
+
+            case 'a':
+                gl_settings.accept_rate_per_ip = atoll(optarg);
+                break;
+
+            case 'q':
+                gl_settings.quantum = parse_size(optarg);
+                break;
+
+            case 'R':
+                gl_settings.resolve_interval = atoll(optarg);
+                break;
+
+            case 'U':
+                gl_settings.udp = 1;
+                break;
+
+            case 'G':
+                gl_settings.udp_gro = 1;
+                break;
+
+            case 'T':
+                gl_settings.udp_timeout = atoll(optarg);
+                break;
+
+            case 't':
+                if (strcmp(optarg, "redirect") == 0) {
+                    gl_settings.transparent = TRANSPARENT_REDIRECT;
+                } else if (strcmp(optarg, "tproxy") == 0) {
+                    gl_settings.transparent = TRANSPARENT_TPROXY;
+                } else {
+                    ERRX("Unknown transparent mode '%s', expected redirect or tproxy", optarg);
+                }
+                break;
+
+            case 's':
+                gl_settings.spoof_source = 1;
+                break;
+
+            case 'o':
+                g_source = optarg;
+                break;
+
+            case 'p':
+                gl_settings.partition_ports = 1;
+                break;
+
+            case 'x':
+                gl_settings.upstream_rst = 1;
+                break;
+
+            case 'F':
+                gl_settings.fastopen = 1;
+                break;
+
+            case 'D':
+                gl_settings.defer_accept = atoll(optarg);
+                break;
+
+            case 'z':
+                gl_settings.lazy_connect = 1;
+                break;
+
+            case 'b':
+                gl_settings.busy_poll = atoll(optarg);
+                break;
+
+            case 'B':
+                gl_settings.busy_spin = atoll(optarg);
+                break;
+
+            case 'k':
+                gl_settings.collect_budget = atoll(optarg);
+                break;
+
+            case 'E':
+                gl_settings.rebalance = 1;
+                break;
+
+            case 'm':
+                if (strcmp(optarg, "reuseport") == 0) {
+                    gl_settings.accept_model = ACCEPT_REUSEPORT;
+                } else if (strcmp(optarg, "shared") == 0) {
+                    gl_settings.accept_model = ACCEPT_SHARED;
+                } else {
+                    ERRX("Unknown accept model '%s', expected reuseport or shared", optarg);
+                }
+                break;
+
+            case 'l':
+                gl_settings.access_log = optarg;
+                break;
+
+            case 'Z':
+                gl_settings.access_log_size = parse_size(optarg);
+                break;
+
+            case 'Y':
+                gl_settings.capture = optarg;
+                break;
+
+            case 'y':
+                g_capture_filter = optarg;
+                break;
+
+            case 'n':
+                gl_settings.admin = optarg;
+                break;
+
+            case 'u':
+                gl_settings.cpu_profile = atoll(optarg);
+                break;
+
+            case 'j':
+                gl_settings.loop_stats = 1;
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (gl_settings.tls_key && !gl_settings.tls_cert)
+        ERRX("--tls-key requires --tls-cert");
+
+    if (gl_settings.udp_gro && !gl_settings.udp)
+        ERRX("--udp-gro requires --udp");
+
+    if (gl_settings.udp && (gl_settings.tls_cert || gl_settings.send_proxy || gl_settings.accept_proxy || g_mirror))
+        ERRX("--udp can't be combined with --tls-cert, --send-proxy, --accept-proxy or --mirror");
+
+    if (gl_settings.transparent && (gl_settings.udp || gl_settings.resolve_interval))
+        ERRX("--transparent can't be combined with --udp or --resolve-interval");
+
+    if (gl_settings.collect_budget && gl_settings.busy_spin)
+        ERRX("--collect-budget can't be combined with --busy-spin");
+
+    if (g_source && gl_settings.spoof_source)
+        ERRX("--source can't be combined with --spoof-source");
+
+    if (gl_settings.udp && (g_source || gl_settings.partition_ports || gl_settings.upstream_rst
+                            || gl_settings.fastopen || gl_settings.defer_accept || gl_settings.lazy_connect
+                            || gl_settings.rebalance || gl_settings.accept_model == ACCEPT_SHARED))
+        ERRX("--udp can't be combined with --source, --partition-ports, --upstream-rst, --fastopen, --defer-accept, --lazy-connect, --rebalance or --accept-model=shared");
+
+    if (gl_settings.udp && (gl_settings.access_log || gl_settings.capture))
+        ERRX("--access-log and --capture don't support --udp");
+
+    if (g_capture_filter && !gl_settings.capture)
+        ERRX("--capture-filter requires --capture");
+
+    // upstream is known only in transparent mode
+    if (argc - optind != (gl_settings.transparent ? 1 : 2)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+socket_set_t* parse_sources(const char* list)
+{
+    // comma separated IPv4/IPv6 addresses, port is chosen by kernel
+    char* copy = strdup(list);
+    size_t count = 1;
+    for (const char* p = list; *p; ++p)
+        if (*p == ',') count++;
+
+    socket_set_t* set = calloc_or_die(1, sizeof(socket_set_t) + count * sizeof(socket_t));
+    set->refs = 1;
+
+    char* save = NULL;
+    for (char* ip = strtok_r(copy, ",", &save); ip; ip = strtok_r(NULL, ",", &save)) {
+        char buf[NET_SOCKET_STRING_SIZE];
+        snprintf(buf, sizeof(buf), strchr(ip, ':') ? "[%s]:0" : "%s:0", ip);
+
+        socket_set_t* resolved = resolve_socket_set(buf, 0);
+        if (!resolved) ERRX("Invalid source address '%s'", ip);
+
+        set->socks[set->count++] = resolved->socks[0];
+        socket_set_unref(resolved);
+    }
+
+    free(copy);
+    if (!set->count) ERRX("Invalid source addresses '%s'", list);
+    return set;
+}
+
+uint32_t worker_port_range(size_t idx, size_t count)
+{
+    // split net.ipv4.ip_local_port_range evenly between workers, 0 if it can't be done
+    unsigned int lo = 0, hi = 0;
+    FILE* file = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+    int ok = file && fscanf(file, "%u %u", &lo, &hi) == 2;
+    if (file) fclose(file);
+
+    if (!ok || hi <= lo || (hi - lo + 1) / count < 2) {
+        ERR("Can't partition ephemeral ports between %zu workers", count);
+        return 0;
+    }
+
+    unsigned int slice = (hi - lo + 1) / count;
+    unsigned int first = lo + idx * slice;
+    unsigned int last = idx + 1 == count ? hi : first + slice - 1;
+
+    INFO("worker %zu uses local ports %u-%u", idx, first, last);
+    return last << 16 | first;
+}
+
+void print_stats(const server_ctx_t* sctxs, size_t count)
+{
+    server_stats_t total;
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < count; ++i) {
+        const server_stats_t* stats = &sctxs[i].stats;
+        char buf[STATS_LINE_SIZE(SERVER_STATS)];
+        int len = 0;
+
+#define X(name)                                                                 \
+        len += snprintf(buf + len, sizeof(buf) - len, " " #name "=%zu",         \
+                        STAT_GET(stats, name));                                 \
+        total.name += STAT_GET(stats, name);
+        SERVER_STATS(X)
+#undef X
+
+        INFO("stats worker=%zu%s", i, buf);
+    }
+
+    char buf[STATS_LINE_SIZE(SERVER_STATS)];
+    int len = 0;
+#define X(name) len += snprintf(buf + len, sizeof(buf) - len, " " #name "=%zu", total.name);
+    SERVER_STATS(X)
+#undef X
+
+    INFO("stats total%s", buf);
+
+    if (gl_settings.resolve_interval) {
+        char rbuf[STATS_LINE_SIZE(RESOLVER_STATS)];
+        len = 0;
+#define X(name) len += snprintf(rbuf + len, sizeof(rbuf) - len, " " #name "=%zu", STAT_GET(&g_resolver.stats, name));
+        RESOLVER_STATS(X)
+#undef X
+
+        INFO("stats resolver%s", rbuf);
+    }
+
+    fflush(stdout);
+}
+
+int wait_quiescent(server_ctx_t* sctxs, size_t count)
+{
+    /* wait until every worker finished a loop iteration, so
+     * none of them still looks at pointers swapped before the call.
+     * Return 0 if it didn't happen in 1s */
+
+    size_t epochs[count];
+    for (size_t i = 0; i < count; ++i) {
+        epochs[i] = __atomic_load_n(&sctxs[i].epoch, __ATOMIC_SEQ_CST);
+        wakeup_server_ctx(&sctxs[i]); // idle loop would never pass quiescent state
+    }
+
+    for (size_t t = 0; t < 100; ++t) {
+        size_t done = 0;
+        for (size_t i = 0; i < count; ++i)
+            done += __atomic_load_n(&sctxs[i].epoch, __ATOMIC_ACQUIRE) != epochs[i];
+
+        if (done == count) return 1;
+        usleep(10000);
+    }
+
+    return 0;
+}
+
+void reload_acl(server_ctx_t* sctxs, size_t count)
+{
+    /* rules are compiled here, in main thread, and swapped in atomically.
+     * Old rules are freed once every worker finished a loop iteration
+     * (i.e. none of accept_cb() calls is still looking at them) */
+
+    acl_t* acl = acl_load(gl_settings.acl_file);
+    if (!acl) {
+        ERR("Keep using previous ACL");
+        return;
+    }
+
+    acl_t* old = sctxs[0].acl;
+    for (size_t i = 0; i < count; ++i)
+        __atomic_store_n(&sctxs[i].acl, acl, __ATOMIC_SEQ_CST);
+
+    if (wait_quiescent(sctxs, count)) {
+        acl_free(old);
+    } else {
+        ERR("Eventloops didn't pass quiescent state in 1s, leaking previous ACL");
+    }
+}
+
 volatile static int g_should_exit = 0;
+volatile static int g_should_reload = 0;
+volatile static int g_should_toggle_capture = 0;
 void sig_handler(int signum)
 {
     switch(signum) {
+        case SIGHUP:
+            INFO("caugth signal SIGHUP");
+            g_should_reload = 1;
+            break;
+
+        case SIGUSR2:
+            INFO("caugth signal SIGUSR2");
+            g_should_toggle_capture = 1;
+            break;
+
         case SIGTERM:
             INFO("caugth signal SIGTERM");
             g_should_exit = 1;
@@ -49,6 +548,145 @@ void sig_handler(int signum)
     }
 }
 
+void resolve_upstream(resolver_t* res)
+{
+    /* getaddrinfo() may block for seconds, so it's done in resolver
+     * thread and workers only see new set once it's ready. Workers
+     * take a reference on the set for each connection attempt, so
+     * resolver drops its own one once they passed quiescent state */
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    socket_set_t* uset = resolve_socket_set(res->host, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    size_t usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    STAT_ADD(&res->stats, resolves, 1);
+    STAT_SET(&res->stats, resolve_last_us, usec);
+    if (usec > res->stats.resolve_max_us)
+        STAT_SET(&res->stats, resolve_max_us, usec);
+
+    if (!uset) {
+        STAT_ADD(&res->stats, resolve_failures, 1);
+        ERR("Keep using previous addresses of %s", res->host);
+        return;
+    }
+
+    socket_set_t* old = res->sctxs[0].uset; // only this thread changes it
+    if (socket_set_equal(uset, old)) {
+        socket_set_unref(uset);
+        return;
+    }
+
+    for (size_t i = 0; i < uset->count; ++i)
+        INFO("upstream %s changed -> %s", res->host, uset->socks[i].to_string);
+
+    for (size_t i = 0; i < res->count; ++i)
+        __atomic_store_n(&res->sctxs[i].uset, uset, __ATOMIC_SEQ_CST);
+
+    STAT_ADD(&res->stats, upstream_changes, 1);
+
+    if (wait_quiescent(res->sctxs, res->count)) {
+        socket_set_unref(old);
+    } else {
+        ERR("Eventloops didn't pass quiescent state in 1s, leaking previous addresses");
+    }
+}
+
+void* run_resolver(void* arg)
+{
+    sigset_t sigs_to_block;
+    sigfillset(&sigs_to_block);
+    pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
+
+    /* getaddrinfo() doesn't tell TTL of records, so resolve with fixed
+     * interval. Caching resolver (nscd, systemd-resolved) would
+     * serve from cache until TTL expires anyway */
+    resolver_t* res = (resolver_t*) arg;
+    while (!g_should_exit) {
+        for (size_t t = 0; t < gl_settings.resolve_interval * 10 && !g_should_exit; ++t)
+            usleep(100000); // 0.1s
+
+        if (!g_should_exit)
+            resolve_upstream(res);
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    access_log_t* log;
+    server_ctx_t* sctxs;
+    size_t count;
+    int stop;                           // set once workers are stopped
+} access_logger_t;
+
+static access_logger_t g_access_logger;
+
+void* run_access_logger(void* arg)
+{
+    sigset_t sigs_to_block;
+    sigfillset(&sigs_to_block);
+    pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
+
+    /* writing to disk may block, so workers only push records
+     * to their rings and this thread writes them out in batches */
+    access_logger_t* logger = (access_logger_t*) arg;
+    while (1) {
+        // records pushed before workers stopped are written out
+        int stop = __atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE);
+
+        size_t count = 0;
+        for (size_t i = 0; i < logger->count; ++i)
+            count += access_log_drain(logger->log, &logger->sctxs[i].access, i);
+
+        if (stop) break;
+        if (!count) usleep(10000);
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    capture_file_t* files;
+    server_ctx_t* sctxs;
+    size_t count;
+    int stop;                           // set once workers are stopped
+} capture_writer_t;
+
+static capture_writer_t g_capture_writer;
+
+void* run_capture_writer(void* arg)
+{
+    sigset_t sigs_to_block;
+    sigfillset(&sigs_to_block);
+    pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
+
+    /* same as access logger, workers only tee() data to capture pipes
+     * and this thread splices it to files. It polls more often as
+     * capture pipe holds much less than access ring */
+    capture_writer_t* writer = (capture_writer_t*) arg;
+    while (1) {
+        int stop = __atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE);
+
+        size_t count = 0;
+        for (size_t i = 0; i < writer->count; ++i) {
+            server_ctx_t* sctx = &writer->sctxs[i];
+            capture_file_t* file = &writer->files[i];
+            int enabled = !stop && __atomic_load_n(&sctx->capture.enabled, __ATOMIC_ACQUIRE);
+
+            count += capture_drain(file, &sctx->capture.ring, sctx->capture.pipefd[0], enabled);
+            if (file->failed && enabled)
+                capture_server_ctx(sctx, 0);
+        }
+
+        if (stop) break;
+        if (!count) usleep(1000);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char** argv)
 {
     struct sigaction sigact;
@@ -58,6 +696,8 @@ int main(int argc, char** argv)
 
     sigaction(SIGINT, &sigact, NULL);
     sigaction(SIGTERM, &sigact, NULL);
+    sigaction(SIGHUP, &sigact, NULL);
+    sigaction(SIGUSR2, &sigact, NULL);
     sigaction(SIGPIPE, &sigact, NULL);
 
     // read global settings
@@ -68,13 +708,58 @@ int main(int argc, char** argv)
     gl_settings.send_size = LOAD_MAX_SETTING;
     gl_settings.minconn = 1000;
     gl_settings.maxconn = 10 * gl_settings.minconn;
+    gl_settings.udp_timeout = 30;
+    gl_settings.access_log_size = 100 << 20;
+    parse_options(argc, argv);
     read_global_settings((GLOBAL*) &gl_settings);
 
-    const char* from = argv[1];
+    // 1 - client side, 2 - server side
+    if (gl_settings.fastopen && (read_proc_setting_int("/proc/sys/net/ipv4/tcp_fastopen") & 3) != 3)
+        INFO("net.ipv4.tcp_fastopen should be 3 for --fastopen to work in both directions");
+
+    if (gl_settings.busy_poll && check_busy_poll())
+        ERRX("Failed to enable --busy-poll");
+
+    if (gl_settings.tls_cert) {
+        const char* key = gl_settings.tls_key ? gl_settings.tls_key : gl_settings.tls_cert;
+        if (tls_init(gl_settings.tls_cert, key))
+            ERRX("Failed to initialize TLS");
+    }
+
+    acl_t* acl = NULL;
+    if (gl_settings.acl_file && !(acl = acl_load(gl_settings.acl_file)))
+        ERRX("Failed to load ACL");
+
+    const char* from = argv[optind];
     socket_t* ssock = socketize(from, NET_SERVER_SOCKET);
 
-    const char* to = argv[2];
-    socket_t* usock = socketize(to, 0);
+    // SO_REUSEPORT doesn't apply to unix sockets, workers share one
+    int lfd = -1;
+    if (ssock->addr.ss_family == AF_UNIX)
+        gl_settings.accept_model = ACCEPT_SHARED;
+
+    if (gl_settings.accept_model == ACCEPT_SHARED && (lfd = setup_server_socket(ssock)) < 0)
+        ERRX("Failed to listen on %s", ssock->to_string);
+
+    const char* to = gl_settings.transparent ? NULL : argv[optind + 1];
+    socket_set_t* uset = to ? socketize_set(to, 0) : NULL;
+
+    if (gl_settings.udp && (ssock->addr.ss_family == AF_UNIX || uset->socks[0].addr.ss_family == AF_UNIX))
+        ERRX("--udp doesn't support unix sockets");
+
+    if (gl_settings.transparent && ssock->addr.ss_family == AF_UNIX)
+        ERRX("--transparent doesn't support unix sockets");
+
+    socket_t* msock = g_mirror ? socketize(g_mirror, 0) : NULL;
+    socket_set_t* sources = g_source ? parse_sources(g_source) : NULL;
+
+    capture_filter_t capture_filter;
+    if (capture_filter_parse(g_capture_filter ? g_capture_filter : "all", &capture_filter))
+        ERRX("Invalid --capture-filter '%s', expected all or ADDR[/LEN]", g_capture_filter);
+
+    access_log_t* access_log = NULL;
+    if (gl_settings.access_log && !(access_log = access_log_open(gl_settings.access_log, gl_settings.access_log_size)))
+        ERRX("Failed to open access log");
 
     const size_t threads = gl_settings.nproc;
     pthread_t server_ctx_ids[threads];
@@ -82,13 +767,91 @@ int main(int argc, char** argv)
     INFO("starting %zu eventloops", threads);
 
     for (size_t i = 0; i < threads; ++i) {
-        if (init_server_ctx(&server_ctxs[i], ssock, usock))
+        if (init_server_ctx(&server_ctxs[i], ssock, lfd, uset, msock))
             ERRX("Failed to initialize one of server contexts");
 
+        server_ctxs[i].worker = i;
+        server_ctxs[i].acl = acl;
+        server_ctxs[i].sources = sources;
+        server_ctxs[i].capture.filter = capture_filter;
+        if (gl_settings.partition_ports)
+            server_ctxs[i].port_range = worker_port_range(i, threads);
+    }
+
+    // no threads are running until all loops are created, see init_server_ctx()
+    for (size_t i = 0; i < threads; ++i)
         server_ctx_ids[i] = start_thread(run_event_loop, server_ctxs[i].loop);
+
+    // running workers may hand connections off only to initialized ones
+    set_server_ctxs(server_ctxs, threads);
+
+    pthread_t resolver_id = 0;
+    if (gl_settings.resolve_interval) {
+        g_resolver.host = to;
+        g_resolver.sctxs = server_ctxs;
+        g_resolver.count = threads;
+        resolver_id = start_thread(run_resolver, &g_resolver);
+    }
+
+    pthread_t access_logger_id = 0;
+    if (access_log) {
+        g_access_logger.log = access_log;
+        g_access_logger.sctxs = server_ctxs;
+        g_access_logger.count = threads;
+        access_logger_id = start_thread(run_access_logger, &g_access_logger);
+    }
+
+    pthread_t capture_writer_id = 0;
+    if (gl_settings.capture) {
+        g_capture_writer.files = calloc_or_die(threads, sizeof(capture_file_t));
+        for (size_t i = 0; i < threads; ++i) {
+            snprintf(g_capture_writer.files[i].path, PATH_MAX, "%s.%zu", gl_settings.capture, i);
+            g_capture_writer.files[i].fd = -1;
+        }
+
+        g_capture_writer.sctxs = server_ctxs;
+        g_capture_writer.count = threads;
+        capture_writer_id = start_thread(run_capture_writer, &g_capture_writer);
+    }
+
+    admin_t* admin = NULL;
+    if (gl_settings.admin && !(admin = admin_open(gl_settings.admin, server_ctxs, threads)))
+        ERR("Continue without admin socket");
+
+    for (size_t ticks = 1; !g_should_exit; ++ticks) {
+        if (admin) {
+            admin_serve(admin, 100);
+        } else {
+            usleep(100000); // 0.1s
+        }
+
+        if (gl_settings.stats_interval && ticks % (gl_settings.stats_interval * 10) == 0)
+            print_stats(server_ctxs, threads);
+
+        if (g_should_reload) {
+            g_should_reload = 0;
+            if (gl_settings.acl_file)
+                reload_acl(server_ctxs, threads);
+        }
+
+        if (g_should_toggle_capture) {
+            g_should_toggle_capture = 0;
+            // admin socket may have changed it as well
+            int capturing = !__atomic_load_n(&server_ctxs[0].capture.enabled, __ATOMIC_ACQUIRE);
+            for (size_t i = 0; gl_settings.capture && i < threads; ++i)
+                capture_server_ctx(&server_ctxs[i], capturing);
+        }
     }
 
-    while (!g_should_exit) usleep(100000); // 0.1s
+    if (gl_settings.resolve_interval)
+        pthread_join(resolver_id, NULL);
+
+    admin_close(admin);
+
+    // stop accepting new clients on unix socket right away
+    const struct sockaddr_un* un = (const struct sockaddr_un*) &ssock->addr;
+    if (ssock->addr.ss_family == AF_UNIX && un->sun_path[0])
+        unlink(un->sun_path);
 
     INFO("Signaling all eventloops to exit");
     for (size_t i = 0; i < threads; ++i) {
@@ -113,6 +876,19 @@ int main(int argc, char** argv)
         return EXIT_SUCCESS;
     }
 
+    if (access_log) {
+        __atomic_store_n(&g_access_logger.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(access_logger_id, NULL);
+        access_log_close(access_log);
+    }
+
+    if (gl_settings.capture) {
+        // closes files as capture is disabled once it's stopped
+        __atomic_store_n(&g_capture_writer.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(capture_writer_id, NULL);
+        free(g_capture_writer.files);
+    }
+
     /* tsan reports lots of data races here,
      * I will ignore them because:
      * a) not enough time
@@ -121,8 +897,13 @@ int main(int argc, char** argv)
         free_server_ctx(&server_ctxs[i]);
     }
 
+    if (lfd >= 0) close(lfd);
     free(ssock);
-    free(usock);
+    socket_set_unref(server_ctxs[0].uset);
+    free(msock);
+    socket_set_unref(sources);
+    acl_free(server_ctxs[0].acl);
+    tls_free();
 
     INFO("Exiting...");
     return EXIT_SUCCESS;
@@ -0,0 +1,226 @@
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "common.h"
+#include "libev/ev.h"
+
+static SSL_CTX* g_ssl_ctx = NULL;
+
+#define ERRSSL(fmt, arg...) \
+    ERR(fmt ": %s", ##arg, ERR_reason_error_string(ERR_get_error()))
+
+int tls_init(const char* cert, const char* key)
+{
+    assert(cert);
+    assert(key);
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERRSSL("Failed to create SSL_CTX");
+        return -1;
+    }
+
+    /* OpenSSL installs negotiated keys into kernel (TCP_ULP "tls")
+     * if kernel and cipher support it. After that the socket carries
+     * plaintext for us and splice() keeps working */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION
+                           | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // no resumption, no need to send tickets after handshake
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        ERRSSL("Failed to load certificate %s", cert);
+        goto error;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+        ERRSSL("Failed to load private key %s", key);
+        goto error;
+    }
+
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        ERRSSL("Private key %s doesn't match certificate", key);
+        goto error;
+    }
+
+    g_ssl_ctx = ctx;
+    INFO("TLS enabled with certificate %s", cert);
+    return 0;
+
+error:
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+void tls_free(void)
+{
+    if (g_ssl_ctx) {
+        SSL_CTX_free(g_ssl_ctx);
+        g_ssl_ctx = NULL;
+    }
+}
+
+tls_conn_t* tls_conn_new(int fd)
+{
+    assert(g_ssl_ctx);
+
+    SSL* ssl = SSL_new(g_ssl_ctx);
+    if (!ssl) {
+        ERRSSL("Failed to create SSL object");
+        return NULL;
+    }
+
+    if (SSL_set_fd(ssl, fd) != 1) {
+        ERRSSL("Failed to set SSL fd");
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    SSL_set_accept_state(ssl);
+
+    tls_conn_t* tls = calloc_or_die(1, sizeof(tls_conn_t));
+    tls->ssl = ssl;
+    return tls;
+}
+
+void tls_conn_free(tls_conn_t* tls)
+{
+    if (!tls) return;
+
+    // best effort close_notify, socket is non-blocking
+    if (SSL_is_init_finished(tls->ssl))
+        SSL_shutdown(tls->ssl);
+
+    SSL_free(tls->ssl);
+    free(tls->rx_buf);
+    free(tls->tx_buf);
+    free(tls);
+}
+
+int tls_handshake(tls_conn_t* tls, int* events)
+{
+    assert(tls);
+    assert(events);
+
+    ERR_clear_error();
+    int ret = SSL_do_handshake(tls->ssl);
+    if (ret == 1) {
+        tls->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl));
+        tls->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+        return 1;
+    }
+
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            *events = EV_READ;
+            return 0;
+
+        case SSL_ERROR_WANT_WRITE:
+            *events = EV_WRITE;
+            return 0;
+
+        case SSL_ERROR_SYSCALL:
+            if (errno) ERRP("TLS handshake failed");
+            return -1;
+
+        default:
+            ERRSSL("TLS handshake failed");
+            return -1;
+    }
+}
+
+inline static
+ssize_t tls_io_error(tls_conn_t* tls, int ret)
+{
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+
+        case SSL_ERROR_ZERO_RETURN:
+            return 0; // close_notify
+
+        case SSL_ERROR_SYSCALL:
+            if (!errno) return 0; // EOF without close_notify
+            return -1;
+
+        default:
+            ERRSSL("TLS I/O failed");
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t tls_splice_read(tls_conn_t* tls, int pipefd, size_t len)
+{
+    assert(tls);
+
+    if (!tls->rx_buf)
+        tls->rx_buf = malloc_or_die(TLS_BUF_SIZE);
+
+    size_t moved = 0;
+    tls->rx_want_read = 0;
+
+    while (1) {
+        // flush decrypted data left from previous call
+        while (tls->rx_off < tls->rx_len) {
+            ssize_t ret = write(pipefd, tls->rx_buf + tls->rx_off, tls->rx_len - tls->rx_off);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                return moved ? (ssize_t) moved : -1; // EAGAIN: pipe is full
+            }
+
+            tls->rx_off += ret;
+            moved += ret;
+        }
+
+        if (moved >= len)
+            return moved;
+
+        /* read_ahead is off and buffer fits a whole record,
+         * so OpenSSL doesn't keep decrypted data inside (no SSL_pending()) */
+        ERR_clear_error();
+        int ret = SSL_read(tls->ssl, tls->rx_buf, TLS_BUF_SIZE);
+        if (ret <= 0) {
+            tls->rx_want_read = SSL_get_error(tls->ssl, ret) == SSL_ERROR_WANT_READ;
+            ssize_t err = tls_io_error(tls, ret);
+            return moved ? (ssize_t) moved : err;
+        }
+
+        tls->rx_off = 0;
+        tls->rx_len = ret;
+    }
+}
+
+ssize_t tls_splice_write(tls_conn_t* tls, int pipefd, size_t len)
+{
+    assert(tls);
+
+    if (!tls->tx_buf)
+        tls->tx_buf = malloc_or_die(TLS_BUF_SIZE);
+
+    /* data is kept in tx_buf until SSL_write() accepts it,
+     * so bytes are reported as moved only after that */
+    if (!tls->tx_len) {
+        ssize_t ret = read(pipefd, tls->tx_buf, len < TLS_BUF_SIZE ? len : TLS_BUF_SIZE);
+        if (ret <= 0) return ret;
+        tls->tx_len = ret;
+    }
+
+    ERR_clear_error();
+    int ret = SSL_write(tls->ssl, tls->tx_buf, tls->tx_len);
+    if (ret <= 0) {
+        ssize_t err = tls_io_error(tls, ret);
+        if (err == 0) errno = EPIPE;
+        return -1;
+    }
+
+    tls->tx_len = 0;
+    return ret;
+}
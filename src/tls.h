@@ -0,0 +1,56 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <sys/types.h>
+
+#define TLS_BUF_SIZE (16 * 1024)        // max plaintext size of TLS record
+
+typedef struct ssl_st SSL;
+
+/* userspace buffers are used only when kernel TLS is not
+ * available for given direction and are allocated on demand */
+typedef struct {
+    SSL* ssl;
+    char* rx_buf;                       // decrypted data not yet written into pipe
+    size_t rx_off, rx_len;
+    char* tx_buf;                       // data taken from pipe, not yet accepted by SSL_write()
+    size_t tx_len;
+    int ktls_rx, ktls_tx;
+    int rx_want_read;                   // last tls_splice_read() stopped on incomplete record
+} tls_conn_t;
+
+// load certificate and key into context shared by all threads
+int tls_init(const char* cert, const char* key);
+void tls_free(void);
+
+tls_conn_t* tls_conn_new(int fd);
+void tls_conn_free(tls_conn_t* tls);
+
+/* drive non-blocking server handshake.
+ * return 1 if done, 0 if in progress (events is set to EV_READ/EV_WRITE
+ * the handshake waits for) and -1 on error */
+int tls_handshake(tls_conn_t* tls, int* events);
+
+/* userspace counterparts of splice() for connections without kTLS.
+ * tls_splice_read() moves up to len (rounded up to a record) decrypted bytes from socket into pipe,
+ * tls_splice_write() moves up to len bytes from pipe to socket encrypting it.
+ * Both follow splice() convention: bytes moved, 0 on EOF, -1 and errno set */
+ssize_t tls_splice_read(tls_conn_t* tls, int pipefd, size_t len);
+ssize_t tls_splice_write(tls_conn_t* tls, int pipefd, size_t len);
+
+// decrypted data is waiting for space in pipe
+inline static
+int tls_rx_pending(const tls_conn_t* tls)
+{
+    return tls && tls->rx_len > tls->rx_off;
+}
+
+/* unlike EAGAIN from splice() which mostly means "pipe is full",
+ * userspace TLS often waits for the rest of a record in socket */
+inline static
+int tls_rx_want_read(const tls_conn_t* tls)
+{
+    return tls && tls->rx_want_read;
+}
+
+#endif
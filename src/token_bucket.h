@@ -0,0 +1,47 @@
+#ifndef __TOKEN_BUCKET_H__
+#define __TOKEN_BUCKET_H__
+
+#include "libev/ev.h"
+
+/* token bucket refilled lazily on access, not thread-safe.
+ * Rate and burst are not stored in bucket to keep it small,
+ * they're the same for all buckets of the same kind */
+typedef struct {
+    double tokens;
+    ev_tstamp last;
+} token_bucket_t;
+
+inline static
+void tb_init(token_bucket_t* tb, double burst, ev_tstamp now)
+{
+    tb->tokens = burst;
+    tb->last = now;
+}
+
+inline static
+size_t tb_available(token_bucket_t* tb, double rate, double burst, ev_tstamp now)
+{
+    if (now > tb->last) {
+        tb->tokens += (now - tb->last) * rate;
+        if (tb->tokens > burst) tb->tokens = burst;
+        tb->last = now;
+    }
+
+    return tb->tokens > 0 ? (size_t) tb->tokens : 0;
+}
+
+inline static
+void tb_consume(token_bucket_t* tb, size_t amount)
+{
+    // may go negative if more than available was consumed
+    tb->tokens -= amount;
+}
+
+// time till bucket has at least amount tokens (call right after tb_available())
+inline static
+ev_tstamp tb_wait_time(const token_bucket_t* tb, double rate, size_t amount)
+{
+    return tb->tokens >= amount ? 0. : (amount - tb->tokens) / rate;
+}
+
+#endif
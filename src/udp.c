@@ -0,0 +1,430 @@
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include "udp.h"
+#include "common.h"
+#include "config.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// direction of _send_batch(), selects stats counter
+#define UDP_TO_UPSTREAM 0
+#define UDP_TO_CLIENT   1
+
+typedef struct {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    char data[UDP_BATCH][UDP_BUFFER_SIZE];
+} udp_batch_t;
+
+inline static void listener_cb(struct ev_loop* loop, ev_io* w, int revents);
+inline static void flow_cb(struct ev_loop* loop, ev_io* w, int revents);
+inline static void expire_cb(struct ev_loop* loop, ev_timer* w, int revents);
+
+inline static int _recv_batch(udp_batch_t* batch, int fd, int with_addr);
+inline static void _send_batch(udp_ctx_t* udp, int fd, struct mmsghdr* msgs, size_t count, int dir);
+inline static uint64_t _hash_addr(const struct sockaddr_storage* addr, socklen_t addrlen);
+inline static int _connect_upstream(const socket_set_t* uset, const socket_t** usock);
+inline static udp_flow_t* _get_flow(udp_ctx_t* udp, struct ev_loop* loop, const struct sockaddr_storage* addr, socklen_t addrlen);
+inline static void _touch_flow(udp_ctx_t* udp, udp_flow_t* flow, ev_tstamp now);
+inline static void _close_flow(udp_ctx_t* udp, struct ev_loop* loop, udp_flow_t* flow);
+inline static int _enable_gro(int fd);
+
+int udp_init(udp_ctx_t* udp, struct ev_loop* loop, int fd,
+             socket_set_t* const* uset, acl_t* const* acl, server_stats_t* stats)
+{
+    assert(udp);
+
+    size_t count = gl_settings.maxconn;
+    size_t buckets = 1;
+    while (buckets < 2 * count) buckets <<= 1;
+
+    // udp_free() may be called from here on
+    udp->lru_head = udp->lru_tail = -1;
+    udp->io.data = udp;
+    ev_io_init(&udp->io, listener_cb, fd, EV_READ);
+    udp->expire.data = udp;
+    ev_timer_init(&udp->expire, expire_cb, 1., 1.);
+
+    udp->flows = calloc(count, sizeof(udp_flow_t));
+    udp->buckets = malloc(buckets * sizeof(int));
+    udp->free = stack_init(count);
+    udp->batch = malloc(sizeof(udp_batch_t));
+
+    if (!udp->flows || !udp->buckets || !udp->free || !udp->batch) {
+        ERR("Failed to allocate UDP flow table");
+        udp_free(udp, loop);
+        return -1;
+    }
+
+    if (gl_settings.udp_gro && _enable_gro(fd)) {
+        udp_free(udp, loop);
+        return -1;
+    }
+
+    for (size_t i = 0; i < buckets; ++i)
+        udp->buckets[i] = -1;
+
+    for (int i = count - 1; i >= 0; --i)
+        stack_push(udp->free, i);
+
+    udp->buckets_mask = buckets - 1;
+    udp->uset = uset;
+    udp->acl = acl;
+    udp->stats = stats;
+
+    ev_io_start(loop, &udp->io);
+    ev_timer_start(loop, &udp->expire);
+    return 0;
+}
+
+// udp_ctx_t must be either zeroed or passed to udp_init()
+void udp_free(udp_ctx_t* udp, struct ev_loop* loop)
+{
+    if (!udp) return;
+
+    if (udp->flows) {
+        while (udp->lru_head >= 0)
+            _close_flow(udp, loop, &udp->flows[udp->lru_head]);
+
+        ev_io_stop(loop, &udp->io);
+        ev_timer_stop(loop, &udp->expire);
+    }
+
+    free(udp->flows);
+    free(udp->buckets);
+    free(udp->batch);
+    if (udp->free) stack_free(udp->free);
+
+    udp->flows = NULL;
+    udp->buckets = NULL;
+    udp->batch = NULL;
+    udp->free = NULL;
+}
+
+/******************************************************************
+ * relaying datagrams                                             *
+ ******************************************************************/
+
+inline static
+void listener_cb(struct ev_loop* loop, ev_io* w, int revents)
+{
+    // client -> upstream
+    udp_ctx_t* udp = (udp_ctx_t*) w->data;
+    udp_batch_t* batch = (udp_batch_t*) udp->batch;
+
+    int count = _recv_batch(batch, w->fd, 1);
+    if (count <= 0) return;
+
+    STAT_ADD(udp->stats, udp_from_clients, count);
+
+    // consecutive datagrams of same flow go with one sendmmsg()
+    udp_flow_t* run = NULL;
+    int start = 0;
+
+    for (int i = 0; i < count; ++i) {
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+        udp_flow_t* flow = _get_flow(udp, loop, &batch->addrs[i], hdr->msg_namelen);
+
+        // upstream socket is connected
+        hdr->msg_name = NULL;
+        hdr->msg_namelen = 0;
+
+        if (flow != run) {
+            if (run) _send_batch(udp, run->io.fd, &batch->msgs[start], i - start, UDP_TO_UPSTREAM);
+            run = flow;
+            start = i;
+        }
+
+        if (!flow) STAT_ADD(udp->stats, udp_dropped, 1);
+    }
+
+    if (run) _send_batch(udp, run->io.fd, &batch->msgs[start], count - start, UDP_TO_UPSTREAM);
+}
+
+inline static
+void flow_cb(struct ev_loop* loop, ev_io* w, int revents)
+{
+    // upstream -> client
+    udp_ctx_t* udp = (udp_ctx_t*) w->data;
+    udp_flow_t* flow = (udp_flow_t*) w;
+    udp_batch_t* batch = (udp_batch_t*) udp->batch;
+
+    int count = _recv_batch(batch, w->fd, 0);
+    if (count <= 0) return;
+
+    STAT_ADD(udp->stats, udp_from_upstream, count);
+    _touch_flow(udp, flow, ev_now(loop));
+
+    for (int i = 0; i < count; ++i) {
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+        hdr->msg_name = &flow->client.addr;
+        hdr->msg_namelen = flow->client.addrlen;
+    }
+
+    _send_batch(udp, udp->io.fd, batch->msgs, count, UDP_TO_CLIENT);
+}
+
+inline static
+void expire_cb(struct ev_loop* loop, ev_timer* w, int revents)
+{
+    // list is ordered by last_seen, stop at first fresh flow
+    udp_ctx_t* udp = (udp_ctx_t*) w->data;
+    ev_tstamp deadline = ev_now(loop) - gl_settings.udp_timeout;
+
+    while (udp->lru_head >= 0 && udp->flows[udp->lru_head].last_seen < deadline) {
+        udp_flow_t* flow = &udp->flows[udp->lru_head];
+        INFO("UDP flow from %s expired", flow->client.to_string);
+        _close_flow(udp, loop, flow);
+    }
+}
+
+inline static
+int _recv_batch(udp_batch_t* batch, int fd, int with_addr)
+{
+    /* receive up to UDP_BATCH datagrams and prepare them for sending:
+     * iov_len is trimmed to datagram size and GRO train (several
+     * datagrams coalesced by kernel) gets UDP_SEGMENT to be split back */
+
+    for (int i = 0; i < UDP_BATCH; ++i) {
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+        batch->iovs[i].iov_base = batch->data[i];
+        batch->iovs[i].iov_len = UDP_BUFFER_SIZE;
+        hdr->msg_iov = &batch->iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_name = with_addr ? &batch->addrs[i] : NULL;
+        hdr->msg_namelen = with_addr ? sizeof(batch->addrs[i]) : 0;
+        hdr->msg_control = gl_settings.udp_gro ? batch->control[i] : NULL;
+        hdr->msg_controllen = gl_settings.udp_gro ? sizeof(batch->control[i]) : 0;
+        hdr->msg_flags = 0;
+    }
+
+    int count = recvmmsg(fd, batch->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        // ECONNREFUSED is ICMP error from upstream, nothing to do about it
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+            ERRP("recvmmsg() failed");
+
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+        size_t len = batch->msgs[i].msg_len;
+        batch->iovs[i].iov_len = len;
+
+        int segment = 0;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+        for (; cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+        }
+
+        if (segment > 0 && (size_t) segment < len) {
+            uint16_t size = segment;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(size));
+            cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+            memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        } else {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+    }
+
+    return count;
+}
+
+inline static
+void _send_batch(udp_ctx_t* udp, int fd, struct mmsghdr* msgs, size_t count, int dir)
+{
+    // UDP is lossy anyway, datagrams which don't fit in socket buffer are dropped
+    size_t sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(fd, msgs + sent, count - sent, MSG_DONTWAIT);
+        if (ret > 0) {
+            sent += ret;
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != ECONNREFUSED)
+                ERRP("sendmmsg() failed");
+
+            STAT_ADD(udp->stats, udp_dropped, count - sent);
+            break;
+        }
+    }
+
+    if (dir == UDP_TO_UPSTREAM) {
+        STAT_ADD(udp->stats, udp_to_upstream, sent);
+    } else {
+        STAT_ADD(udp->stats, udp_to_clients, sent);
+    }
+}
+
+inline static
+uint64_t _hash_addr(const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+    // FNV-1a, addresses are short
+    const unsigned char* bytes = (const unsigned char*) addr;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (socklen_t i = 0; i < addrlen; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+inline static
+udp_flow_t* _get_flow(udp_ctx_t* udp, struct ev_loop* loop, const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+    // find flow of client or create new one, NULL if datagram should be dropped
+    ev_tstamp now = ev_now(loop);
+    uint64_t hash = _hash_addr(addr, addrlen);
+    int* bucket = &udp->buckets[hash & udp->buckets_mask];
+
+    for (int idx = *bucket; idx >= 0; idx = udp->flows[idx].hash_next) {
+        udp_flow_t* flow = &udp->flows[idx];
+        if (flow->hash == hash
+            && flow->client.addrlen == addrlen
+            && memcmp(&flow->client.addr, addr, addrlen) == 0) {
+            _touch_flow(udp, flow, now);
+            return flow;
+        }
+    }
+
+    acl_t* acl = __atomic_load_n(udp->acl, __ATOMIC_ACQUIRE);
+    if (acl && !acl_allowed(acl, addr)) {
+        STAT_ADD(udp->stats, rejected_acl, 1);
+        return NULL;
+    }
+
+    if (stack_empty(udp->free)) {
+        INFO("limit of max UDP flows reached");
+        return NULL;
+    }
+
+    // resolver thread may swap addresses, set isn't freed before loop iteration ends
+    const socket_set_t* uset = __atomic_load_n(udp->uset, __ATOMIC_ACQUIRE);
+    const socket_t* usock = NULL;
+
+    int fd = _connect_upstream(uset, &usock);
+    if (fd < 0) return NULL;
+
+    int idx = stack_pop(udp->free);
+    udp_flow_t* flow = &udp->flows[idx];
+    flow->client.addrlen = addrlen;
+    memcpy(&flow->client.addr, addr, addrlen);
+    humanize_socket(&flow->client);
+    flow->hash = hash;
+    flow->hash_next = *bucket;
+    *bucket = idx;
+
+    flow->lru_prev = flow->lru_next = -1;
+    flow->last_seen = 0;
+    _touch_flow(udp, flow, now);
+
+    flow->io.data = udp;
+    ev_io_init(&flow->io, flow_cb, fd, EV_READ);
+    ev_io_start(loop, &flow->io);
+
+    STAT_ADD(udp->stats, udp_flows, 1);
+    INFO("new UDP flow from %s to %s", flow->client.to_string, usock->to_string);
+    return flow;
+}
+
+inline static
+int _connect_upstream(const socket_set_t* uset, const socket_t** usock)
+{
+    /* addresses are tried in order like TCP connection attempts do.
+     * Connecting UDP socket fails only locally (e.g. no route to IPv6
+     * address), upstream which doesn't answer isn't detected */
+
+    for (size_t i = 0; i < uset->count; ++i) {
+        int fd = setup_socket(&uset->socks[i], NET_UDP_SOCKET);
+        if (fd < 0) continue;
+
+        if (connect_client_socket(&uset->socks[i], fd) < 0) {
+            ERRP("Failed to connect UDP socket to %s", uset->socks[i].to_string);
+            close(fd);
+            continue;
+        }
+
+        if (gl_settings.udp_gro && _enable_gro(fd)) {
+            close(fd);
+            continue;
+        }
+
+        *usock = &uset->socks[i];
+        return fd;
+    }
+
+    return -1;
+}
+
+inline static
+void _touch_flow(udp_ctx_t* udp, udp_flow_t* flow, ev_tstamp now)
+{
+    // move to the tail of LRU list
+    flow->last_seen = now;
+
+    int idx = flow - udp->flows;
+    if (udp->lru_tail == idx) return;
+
+    if (flow->lru_prev >= 0) udp->flows[flow->lru_prev].lru_next = flow->lru_next;
+    if (flow->lru_next >= 0) udp->flows[flow->lru_next].lru_prev = flow->lru_prev;
+    if (udp->lru_head == idx) udp->lru_head = flow->lru_next;
+
+    flow->lru_prev = udp->lru_tail;
+    flow->lru_next = -1;
+    if (udp->lru_tail >= 0) udp->flows[udp->lru_tail].lru_next = idx;
+    udp->lru_tail = idx;
+    if (udp->lru_head < 0) udp->lru_head = idx;
+}
+
+inline static
+void _close_flow(udp_ctx_t* udp, struct ev_loop* loop, udp_flow_t* flow)
+{
+    int idx = flow - udp->flows;
+
+    ev_io_stop(loop, &flow->io);
+    close(flow->io.fd);
+    flow->io.fd = -1;
+
+    int* link = &udp->buckets[flow->hash & udp->buckets_mask];
+    while (*link != idx) link = &udp->flows[*link].hash_next;
+    *link = flow->hash_next;
+
+    if (flow->lru_prev >= 0) udp->flows[flow->lru_prev].lru_next = flow->lru_next;
+    if (flow->lru_next >= 0) udp->flows[flow->lru_next].lru_prev = flow->lru_prev;
+    if (udp->lru_head == idx) udp->lru_head = flow->lru_next;
+    if (udp->lru_tail == idx) udp->lru_tail = flow->lru_prev;
+
+    stack_push(udp->free, idx);
+}
+
+inline static
+int _enable_gro(int fd)
+{
+    // receive trains of datagrams as one buffer, needs Linux 5.0
+    int yes = 1;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &yes, sizeof(yes))) {
+        ERRP("Failed to setsockopt UDP_GRO");
+        return -1;
+    }
+
+    return 0;
+}
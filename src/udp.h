@@ -0,0 +1,49 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include <stdint.h>
+
+#include "acl.h"
+#include "net.h"
+#include "stack.h"
+#include "stats.h"
+#include "libev/ev.h"
+
+#define UDP_BATCH       32              // datagrams per recvmmsg()/sendmmsg()
+#define UDP_BUFFER_SIZE 65536           // max datagram (or GRO train) size
+
+/* flow is a client address with its own connected socket to upstream,
+ * so that replies are matched by kernel and sent back to the client */
+typedef struct {
+    ev_io io;                           // socket to upstream, must be first member
+    socket_t client;                    // client address, key in udp_ctx_t.buckets
+    uint64_t hash;
+    ev_tstamp last_seen;
+    int hash_next;                      // next flow in hash chain
+    int lru_prev;                       // udp_ctx_t.lru list, least recently used first
+    int lru_next;
+} udp_flow_t;
+
+/* per worker state of UDP mode. Flows are preallocated (maxconn of
+ * them) and linked by indexes, there is no allocation per datagram */
+typedef struct {
+    ev_io io;                           // listening socket, shared with server_ctx_t.io which owns it
+    ev_timer expire;                    // closes idle flows
+    udp_flow_t* flows;
+    int_stack_t* free;                  // free indexes in flows
+    int* buckets;                       // heads of hash chains, -1 if empty
+    size_t buckets_mask;
+    int lru_head;
+    int lru_tail;
+    void* batch;                        // recvmmsg()/sendmmsg() buffers, see udp.c
+
+    socket_set_t* const* uset;          // server_ctx_t.uset, swapped by resolver thread
+    acl_t* const* acl;                  // server_ctx_t.acl, swapped on SIGHUP
+    server_stats_t* stats;
+} udp_ctx_t;
+
+int udp_init(udp_ctx_t* udp, struct ev_loop* loop, int fd,
+             socket_set_t* const* uset, acl_t* const* acl, server_stats_t* stats);
+void udp_free(udp_ctx_t* udp, struct ev_loop* loop);
+
+#endif